@@ -0,0 +1,113 @@
+"""Benchmarks for the CUDA resource holders.
+
+Usage: python bench_holders.py [benchmark ...]
+
+Runs every benchmark when none is named. The module must be built first
+(see build.sh).
+"""
+import gc
+import os
+import sys
+
+import cuda_core_holders_demo as holders
+
+
+def bench_shared_owners():
+    """Scaling of threads capturing buffers that share one pool and stream."""
+    iters = 1_000_000
+    max_threads = os.cpu_count() or 1
+    nthreads = [1]
+    while nthreads[-1] * 2 <= max_threads:
+        nthreads.append(nthreads[-1] * 2)
+
+    print(f"{'threads':>8} {'plain ns/capture':>18} {'sharded ns/capture':>20}")
+    for n in nthreads:
+        plain = holders.bench.shared_owners(n, iters, sharded=False)
+        sharded = holders.bench.shared_owners(n, iters, sharded=True)
+        print(f"{n:>8} {plain:>18.1f} {sharded:>20.1f}")
+
+
+def bench_footprint():
+    """Bytes per live holder, by layer, in C++ and in Python."""
+    n = 200_000
+    types = {
+        "Stream": holders.Stream,
+        "MemPool": holders.MemPool,
+        "Deviceptr": holders.Deviceptr,
+        "slots.Deviceptr": holders.slots.Deviceptr,
+    }
+
+    # C++ holders, made like capture and capture_cached make them.
+    layers = ["holder", "box", "control_block", "cache_node"]
+    print(f"{'C++ type':<16} {'cached':>6}" + "".join(f" {l:>13}" for l in layers)
+          + f" {'heap':>8} {'rss':>8}")
+    cxx = {}
+    for name in types:
+        for cached in (False, True):
+            if cached and name.startswith("slots."):
+                continue
+            row = holders.bench.footprint(name, n, cached)
+            cxx[name, cached] = row
+            print(f"{name:<16} {str(cached):>6}"
+                  + "".join(f" {row[l]:>13.1f}" for l in layers)
+                  + f" {row['heap_per_holder']:>8.1f} {row['rss_per_holder']:>8.1f}")
+
+    # Python holders, uncached from capture_static, and cached from the
+    # registry capture uses. C++ heap not explained by the C++ layers above
+    # is mostly the pybind11 instance registry and the list holding the
+    # objects.
+    print(f"\n{'Python type':<16} {'cached':>6} {'instance':>9} {'c++ layers':>11}"
+          f" {'registry+other':>15} {'heap':>8} {'rss':>8}")
+    for name, cls in types.items():
+        for cached in (False, True):
+            if cached and name.startswith("slots."):
+                continue
+            if cached:
+                make = lambda i: holders.bench.capture(name, 0x1000 + i)
+            else:
+                make = lambda i: cls.capture_static(0x1000 + i)
+            gc.collect()
+            heap0, rss0 = holders.bench.heap_bytes(), holders.bench.rss_bytes()
+            objs = [make(i) for i in range(n)]
+            heap = (holders.bench.heap_bytes() - heap0) / n
+            rss = (holders.bench.rss_bytes() - rss0) / n
+            instance = sys.getsizeof(objs[0])
+            row = cxx[name, cached]
+            layers_heap = row["box"] + row["control_block"] + row["cache_node"]
+            print(f"{name:<16} {str(cached):>6} {instance:>9} {layers_heap:>11.1f}"
+                  f" {heap - layers_heap:>15.1f} {heap:>8.1f} {rss:>8.1f}")
+            del objs
+
+
+def bench_host_registration():
+    """Registering one host buffer repeatedly, with and without the cache."""
+    iters = 1_000
+    print(f"{'bytes':>10} {'driver ns/register':>19} {'cached ns/register':>19}")
+    for nbytes in (1 << 12, 1 << 20, 1 << 26):
+        driver = holders.bench.host_registration(nbytes, iters, cached=False)
+        cached = holders.bench.host_registration(nbytes, iters, cached=True)
+        print(f"{nbytes:>10} {driver:>19.1f} {cached:>19.1f}")
+
+
+def bench_launch():
+    """Host cost of launches with holder arguments, on the stub driver."""
+    iters = 200_000
+    raw = holders.bench.launch(iters, holders=False)
+    held = holders.bench.launch(iters, holders=True)
+    print(f"{'driver ns/launch':>17} {'launch ns/launch':>17} {'overhead':>9}")
+    print(f"{raw:>17.1f} {held:>17.1f} {held - raw:>9.1f}")
+
+
+BENCHMARKS = {
+    "shared_owners": bench_shared_owners,
+    "footprint": bench_footprint,
+    "host_registration": bench_host_registration,
+    "launch": bench_launch,
+}
+
+
+if __name__ == "__main__":
+    names = sys.argv[1:] or list(BENCHMARKS)
+    for name in names:
+        print(f"\n{name}: {BENCHMARKS[name].__doc__}")
+        BENCHMARKS[name]()
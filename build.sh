@@ -3,6 +3,17 @@
 set -e
 PYBIND_INCLUDES=$(pybind11-config --includes)
 CUDA_INCLUDES=-I$CUDA_PATH/include
-CUDA_LINK=$CUDA_PATH/lib/stubs/libcuda.so
-CXXFLAGS="-O3 -Wall -shared -fPIC -std=c++17"
-g++ $CXXFLAGS $PYBIND_INCLUDES $CUDA_INCLUDES -o cuda_core_holders_demo.so cuda_core_holders_demo.cpp $CUDA_LINK
+CXXFLAGS="-O3 -Wall -shared -fPIC -pthread -std=c++17"
+g++ $CXXFLAGS $PYBIND_INCLUDES $CUDA_INCLUDES -o cuda_core_holders_demo.so cuda_core_holders_demo.cpp -ldl
+
+# ./build.sh stub also builds the stub driver (see stub_driver.cpp), and
+# ./build.sh test also runs the C++ tests against it.
+if [ "$1" == "stub" ] || [ "$1" == "test" ]; then
+  mkdir -p stub
+  g++ -O2 -Wall -shared -fPIC -std=c++17 $CUDA_INCLUDES -Wl,-soname,libcuda.so.1 -o stub/libcuda.so.1 stub_driver.cpp -ldl
+fi
+if [ "$1" == "test" ]; then
+  g++ -O2 -Wall -pthread -std=c++20 -I. $CUDA_INCLUDES -o stub/test_awaiters test_awaiters.cpp \
+    -Lstub -l:libcuda.so.1 -Wl,-rpath,'$ORIGIN'
+  stub/test_awaiters
+fi
@@ -0,0 +1,222 @@
+// Coroutine Awaiters
+// ==================
+//
+// With C++20, `co_await completed(stream)` suspends a coroutine until the
+// work queued so far on a stream completes, and `co_await completed(event)`
+// until the work recorded in an event does. A stream is awaited through an
+// event recorded on it.
+//
+// Awaited events are polled by a completion poller, one thread that queries
+// every pending event in turn. The coroutine is handed to the executor, if
+// given, and is otherwise resumed on the poller thread, so it must not block
+// there. Driver calls are allowed on that thread.
+//
+// Holders are awaited the same way, `co_await completed(h_stream)`. A holder
+// is any pointer-like object to a box whose `res` is a CUstream or CUevent,
+// such as the holders module's StreamH and EventH. The awaiter holds it until
+// the coroutine has been resumed or handed to the executor. A raw event must
+// outlive the wait.
+//
+// Other completion sources plug in with awaiting(source). A source is called
+// once, on suspension, with an action to run when the awaited work
+// completes.
+//
+// Only the driver API is used, so services can include this header on its
+// own, and link with libcuda.
+
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <coroutine>
+#include <cuda.h>
+#include <functional>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace cuda_holders
+{
+  using Executor = std::function<void(std::coroutine_handle<>)>;
+
+  template<typename Source>
+  class CompletionAwaiter
+  {
+  public:
+    CompletionAwaiter(Source source, Executor executor)
+      : source{std::move(source)}, executor{std::move(executor)}
+    {}
+
+    bool await_ready() const noexcept { return false; }
+
+    void await_suspend(std::coroutine_handle<> handle)
+    {
+      // The coroutine may resume, and destroy this awaiter, before the
+      // source returns.
+      auto source = std::move(this->source);
+      source([handle, executor = std::move(executor)]
+        {
+          if (executor) { executor(handle); } else { handle.resume(); }
+        });
+    }
+
+    void await_resume() const noexcept {}
+
+  private:
+    Source source;
+    Executor executor;
+  };
+
+  template<typename Source>
+  auto awaiting(Source source, Executor executor = {})
+  {
+    return CompletionAwaiter<Source>(std::move(source), std::move(executor));
+  }
+
+  // Runs an action once its event completes, on the poller thread. The
+  // thread queries the pending events in turn, and sleeps for the poll
+  // interval after a pass that completes none. Destroying the poller waits
+  // for the pending events.
+  class CompletionPoller
+  {
+  public:
+    explicit CompletionPoller(
+        std::chrono::microseconds interval = std::chrono::microseconds(50)
+      )
+      : interval{interval}
+    {}
+
+    ~CompletionPoller()
+    {
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+      }
+      wake.notify_one();
+      if (thread.joinable()) { thread.join(); }
+    }
+
+    CompletionPoller(CompletionPoller const &) = delete;
+    CompletionPoller & operator=(CompletionPoller const &) = delete;
+
+    // Runs action once event completes. An owned event is destroyed then.
+    // Errors are left to the next driver call, so an event that fails to
+    // query counts as complete.
+    void watch(CUevent event, std::function<void()> action, bool owned = false)
+    {
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        incoming.push_back({event, std::move(action), owned});
+        if (!thread.joinable()) { thread = std::thread([this] { run(); }); }
+      }
+      wake.notify_one();
+    }
+
+    // Runs action once the work queued so far on stream completes.
+    void watch(CUstream stream, std::function<void()> action)
+    {
+      CUevent event = nullptr;
+      auto result = cuEventCreate(&event, CU_EVENT_DISABLE_TIMING);
+      if (result == CUDA_SUCCESS) {
+        result = cuEventRecord(event, stream);
+        if (result != CUDA_SUCCESS) { cuEventDestroy(event); }
+      }
+      if (result != CUDA_SUCCESS) {
+        throw std::runtime_error("Recording a stream completion failed with CUDA error " + std::to_string(result));
+      }
+      watch(event, std::move(action), true);
+    }
+
+  private:
+    struct Pending
+    {
+      CUevent event;
+      std::function<void()> action;
+      bool owned;
+    };
+
+    void run()
+    {
+      std::vector<Pending> polling;
+      std::vector<Pending> done;
+      std::unique_lock<std::mutex> lock(mutex);
+      for (;;) {
+        for (auto & pending : incoming) { polling.push_back(std::move(pending)); }
+        incoming.clear();
+        if (polling.empty()) {
+          if (stopping) { return; }
+          wake.wait(lock, [this] { return stopping || !incoming.empty(); });
+          continue;
+        }
+        lock.unlock();
+
+        for (auto it = polling.begin(); it != polling.end(); ) {
+          if (cuEventQuery(it->event) == CUDA_ERROR_NOT_READY) {
+            ++it;
+          } else {
+            done.push_back(std::move(*it));
+            it = polling.erase(it);
+          }
+        }
+        for (auto & pending : done) {
+          if (pending.owned) { cuEventDestroy(pending.event); }
+          pending.action();
+        }
+        bool const idle = done.empty();
+        done.clear();
+
+        lock.lock();
+        if (idle && incoming.empty()) { wake.wait_for(lock, interval); }
+      }
+    }
+
+    std::chrono::microseconds const interval;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::vector<Pending> incoming;
+    bool stopping = false;
+    std::thread thread; // started on the first watch
+  };
+
+  // The poller used by completed().
+  inline CompletionPoller & completion_poller()
+  {
+    static CompletionPoller poller;
+    return poller;
+  }
+
+  inline auto completed(CUstream stream, Executor executor = {})
+  {
+    return awaiting([stream](std::function<void()> action)
+      {
+        completion_poller().watch(stream, std::move(action));
+      }, std::move(executor));
+  }
+
+  inline auto completed(CUevent event, Executor executor = {})
+  {
+    return awaiting([event](std::function<void()> action)
+      {
+        completion_poller().watch(event, std::move(action));
+      }, std::move(executor));
+  }
+
+  template<typename Holder>
+    requires std::is_same_v<std::remove_cvref_t<decltype(std::declval<Holder const &>()->res)>, CUstream>
+      || std::is_same_v<std::remove_cvref_t<decltype(std::declval<Holder const &>()->res)>, CUevent>
+  auto completed(Holder holder, Executor executor = {})
+  {
+    return awaiting([holder = std::move(holder)](std::function<void()> action) mutable
+      {
+        auto const res = holder->res;
+        completion_poller().watch(res, [holder = std::move(holder), action = std::move(action)]
+          {
+            action();
+          });
+      }, std::move(executor));
+  }
+}
@@ -1,14 +1,39 @@
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cerrno>
+#include <climits>
 #include <cuda.h>
+#include <dlfcn.h>
+#include <deque>
+#include <fcntl.h>
+#include <functional>
+#include <fstream>
 #include <iomanip>
 #include <iostream>
+#include <list>
+#include <malloc.h>
+#include <map>
 #include <unordered_map>
 #include <memory>
+#include <mutex>
+#include <optional>
 #include <pybind11/pybind11.h>
 #include <pybind11/stl.h>
+#include <set>
 #include <sstream>
 #include <stdexcept>
 #include <string>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+#include <system_error>
+#include <thread>
+#include <tuple>
 #include <type_traits>
+#include <unistd.h>
+#include <vector>
 
 // Boxes
 // =====
@@ -35,6 +60,10 @@
 //       dealloation function. E.g., for Deviceptr, a stream holder (StreamH)
 //       specifying the stream to deallocate on when using cuMemFreeAsyc.
 //
+//   - Device
+//       The ordinal of the device the resource belongs to. Registries and
+//       usage counters are partitioned by it.
+//
 // Properties:
 //
 //   - Default constructible
@@ -70,6 +99,83 @@
 //       potentially freeing the boxed CUDA resource, while retaining a valid
 //       box. This allows holders to serve as pybind11 holders.
 //
+//   - Unique per handle
+//       Each box type keeps a registry (its `cache`) of the live holders it
+//       captured, by handle. Capturing a handle that is already owned returns
+//       the existing holder, rather than a second owner with its own deleter,
+//       so a resource is never released twice. Arguments such as owners and
+//       destructor arguments are ignored in that case. Wrapping a static
+//       resource bypasses the registry.
+//
+//   - Partitioned by device
+//       Registries are split by device, so that threads working on different
+//       devices do not share locks or cache lines. A stream's device is that
+//       of its context, an allocation's that of its pool. A memory pool's
+//       device cannot be queried, so it is the current device unless given
+//       on capture. A handle captured again as another device is found in
+//       the partition it was first captured in, so it still has one owner.
+//
+//
+// Sharded Holders
+// ===============
+//
+// Owners such as a stream or memory pool may be copied from many threads at
+// once. A sharded holder shares ownership with an ordinary holder, but counts
+// its references in per-thread shards, so that copies made on different
+// threads touch different cache lines:
+//
+//     using StreamSH = ShardedH<Stream>;
+//
+// Properties:
+//
+//   - Interoperable
+//       A sharded holder is implicitly constructed from the corresponding
+//       holder, and `shared()` recovers one. Each shard holds one reference
+//       of the underlying holder, so the box is released as usual once the
+//       last shard is gone.
+//
+//   - Thread-affine counting
+//       Copying on the thread that created the shard is one uncontended
+//       atomic increment. Copying on another thread moves the copy to that
+//       thread's shard. Dropping a copy on a foreign thread is correct, but
+//       touches the remote shard.
+//
+//   - pybind11 holder
+//       Sharded holders are constructible from a box pointer, expose `get()`
+//       and are copyable, so they can serve as pybind11 holders.
+//
+//   - Opt-in
+//       Making a sharded holder from an ordinary one looks up the thread's
+//       shard, which costs more than the increment it saves unless the
+//       sharded holder is then copied many times. The boxes here hold their
+//       owners in ordinary holders; `bench.shared_owners` compares the two.
+//
+//
+// Slot Holders
+// ============
+//
+// For very many small resources, a heap box plus a shared_ptr control block
+// per resource is too heavy. As an alternative backend, boxes can live in a
+// generational slot table, where a holder is a 32-bit slot index plus the
+// generation of the slot:
+//
+//     using SlotDeviceptrH = SlotH<SlotDeviceptr>;
+//
+// Properties:
+//
+//   - Table-resident
+//       Boxes and their reference counts are stored in the slot table, in
+//       chunks that never move. Looking up a slot by index is O(1), and
+//       iterating over live boxes walks contiguous memory.
+//
+//   - Generational
+//       Releasing the last holder frees the resource and bumps the slot
+//       generation, so that stale (index, generation) pairs are detected.
+//
+//   - pybind11 holder
+//       Slot holders are constructible from a pointer obtained from `get()`
+//       on another holder, expose `get()` and are copyable.
+//
 //
 // Python Holders
 // ==============
@@ -114,14 +220,169 @@ namespace py = pybind11;
 
 namespace
 {
+  // Driver
+  // ======
+  //
+  // libcuda is loaded on first use rather than at import, so that processes
+  // that never touch the GPU do not pay for it. Its entry points are
+  // resolved once, with cuGetProcAddress for the CUDA version built
+  // against, into a table that every driver call goes through. The library
+  // loaded is $CUDA_HOLDERS_DRIVER if set, libcuda.so.1 otherwise, unless
+  // load_driver is called first with another one, e.g. a stub. Entry points
+  // the driver lacks return CUDA_ERROR_NOT_FOUND.
+  #define DRIVER_ENTRY_POINTS(X) \
+    X(cuCtxEnablePeerAccess) \
+    X(cuCtxGetCurrent) \
+    X(cuCtxGetDevice) \
+    X(cuCtxGetStreamPriorityRange) \
+    X(cuCtxPopCurrent) \
+    X(cuCtxPushCurrent) \
+    X(cuCtxSetCurrent) \
+    X(cuDeviceCanAccessPeer) \
+    X(cuDeviceGet) \
+    X(cuDeviceGetCount) \
+    X(cuDevicePrimaryCtxRetain) \
+    X(cuEventCreate) \
+    X(cuEventDestroy) \
+    X(cuEventElapsedTime) \
+    X(cuEventQuery) \
+    X(cuEventRecord) \
+    X(cuEventSynchronize) \
+    X(cuGetErrorString) \
+    X(cuGraphExecDestroy) \
+    X(cuLaunchKernel) \
+    X(cuMemAdvise) \
+    X(cuMemAllocFromPoolAsync) \
+    X(cuMemAllocHost) \
+    X(cuMemAllocManaged) \
+    X(cuMemFree) \
+    X(cuMemFreeAsync) \
+    X(cuMemFreeHost) \
+    X(cuMemHostAlloc) \
+    X(cuMemHostRegister) \
+    X(cuMemHostUnregister) \
+    X(cuMemPoolDestroy) \
+    X(cuMemPoolSetAccess) \
+    X(cuMemPoolTrimTo) \
+    X(cuMemPrefetchAsync) \
+    X(cuMemcpyAsync) \
+    X(cuMemcpyDtoHAsync) \
+    X(cuMemcpyHtoDAsync) \
+    X(cuStreamCreateWithPriority) \
+    X(cuStreamDestroy) \
+    X(cuStreamGetCtx) \
+    X(cuStreamIsCapturing) \
+    X(cuStreamSynchronize) \
+    X(cuStreamWaitEvent)
+
+  template<typename Fn> struct MissingEntryPoint;
+
+  template<typename... Args>
+  struct MissingEntryPoint<CUresult (CUDAAPI *)(Args...)>
+  {
+    static CUresult CUDAAPI call(Args...) { return CUDA_ERROR_NOT_FOUND; }
+  };
+
+  class Driver
+  {
+  public:
+    #define DRIVER_ENTRY_POINT(name) \
+      decltype(&::name) name = MissingEntryPoint<decltype(&::name)>::call;
+    DRIVER_ENTRY_POINTS(DRIVER_ENTRY_POINT)
+    #undef DRIVER_ENTRY_POINT
+
+    std::string path;
+
+    // Loads the driver at path, unless it is loaded already. Throws if
+    // another one is.
+    static auto load(std::string const & path) -> Driver const &
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      if (auto const * driver = instance.load()) {
+        if (driver->path != path) {
+          throw std::runtime_error("CUDA driver " + driver->path + " is loaded already");
+        }
+        return *driver;
+      }
+      auto const * driver = open(path);
+      instance.store(driver, std::memory_order_release);
+      return *driver;
+    }
+
+    static auto loaded() -> Driver const *
+    {
+      return instance.load(std::memory_order_acquire);
+    }
+
+  private:
+    using GetProcAddress = decltype(&::cuGetProcAddress);
+
+    // Never unloaded, since boxes may outlive the module.
+    static auto open(std::string const & path) -> Driver const *
+    {
+      auto * handle = dlopen(path.c_str(), RTLD_NOW | RTLD_LOCAL);
+      if (!handle) {
+        throw std::runtime_error(std::string("Cannot load CUDA driver: ") + dlerror());
+      }
+      #if CUDA_VERSION >= 12000
+      auto const * symbol = "cuGetProcAddress_v2";
+      #else
+      auto const * symbol = "cuGetProcAddress";
+      #endif
+      auto const get = reinterpret_cast<GetProcAddress>(dlsym(handle, symbol));
+      if (!get) {
+        dlclose(handle);
+        throw std::runtime_error("CUDA driver " + path + " lacks " + symbol);
+      }
+      MESSAGE("Loading CUDA driver " << path);
+      auto driver = std::make_unique<Driver>();
+      driver->path = path;
+      #define DRIVER_RESOLVE(name) resolve(get, #name, driver->name);
+      DRIVER_ENTRY_POINTS(DRIVER_RESOLVE)
+      #undef DRIVER_RESOLVE
+      return driver.release();
+    }
+
+    template<typename Fn>
+    static void resolve(GetProcAddress get, char const * symbol, Fn & entry)
+    {
+      void * fn = nullptr;
+      #if CUDA_VERSION >= 12000
+      CUdriverProcAddressQueryResult status;
+      auto const result = get(symbol, &fn, CUDA_VERSION, CU_GET_PROC_ADDRESS_DEFAULT, &status);
+      #else
+      auto const result = get(symbol, &fn, CUDA_VERSION, CU_GET_PROC_ADDRESS_DEFAULT);
+      #endif
+      if (result == CUDA_SUCCESS && fn) {
+        entry = reinterpret_cast<Fn>(fn);
+      } else {
+        MESSAGE("CUDA driver lacks " << symbol);
+      }
+    }
+
+    static std::mutex mutex;
+    static std::atomic<Driver const *> instance;
+  };
+
+  std::mutex Driver::mutex;
+  std::atomic<Driver const *> Driver::instance{nullptr};
+
+  auto driver() -> Driver const &
+  {
+    if (auto const * loaded = Driver::loaded()) { return *loaded; }
+    auto const * env = std::getenv("CUDA_HOLDERS_DRIVER");
+    return Driver::load(env ? env : "libcuda.so.1");
+  }
+
   [[noreturn]] void raise_cuda_error(CUresult result)
   {
+    // Codes the driver does not know have no message, nor does anything
+    // without cuGetErrorString.
+    auto msg = std::string("CUDA error ") + std::to_string(static_cast<int>(result));
     char const * cuda_msg = nullptr;
-    cuGetErrorString(result, &cuda_msg);
-    auto msg =
-        std::string("CUDA error ")
-      + std::to_string(static_cast<int>(result)) + ": "
-      + cuda_msg;
+    if (driver().cuGetErrorString(result, &cuda_msg) == CUDA_SUCCESS && cuda_msg) {
+      msg += std::string(": ") + cuda_msg;
+    }
     throw std::runtime_error(msg);
   }
 
@@ -140,226 +401,4298 @@ namespace
           return static_cast<uintptr_t>(v);
   }
 
-  #ifdef ENABLE_DIAGNOSTICS
-  static struct CudaResourceUsage
+  template <typename T>
+  T from_uintptr(uintptr_t i) {
+      if constexpr (std::is_pointer_v<T>)
+          return reinterpret_cast<T>(i);
+      else
+          return static_cast<T>(i);
+  }
+
+  // A holder that shares ownership with std::shared_ptr<Box>, with its
+  // reference count sharded per thread. See "Sharded Holders" above.
+  template<typename Box>
+  class ShardedH
   {
-    int streams = 0;
-    int mempools = 0;
-    int devptrs = 0;
+    struct Shard;
 
-    void report()
+    // The shards created by one thread, by box address. An entry is reused
+    // only while its shard count is nonzero, which also guarantees the
+    // address still refers to the same box. Dead entries are swept lazily.
+    struct ShardTable
     {
-      std::cerr << "\n"
-                   "CUDA Core Resource Usage Report\n"
-                   "===============================\n"
-                   "Currently in use:\n"
-                << "    #streams : " << this->streams  << "\n"
-                << "    #mempools: " << this->mempools << "\n"
-                << "    #devptrs : " << this->devptrs  << "\n"
-      ;
-    }
+      std::unordered_map<Box const *, Shard *> shards;
+      size_t sweep_at = 16;
 
-    ~CudaResourceUsage() { this->report(); }
-  } g_usage;
-  #endif
+      void sweep()
+      {
+        for (auto it = shards.begin(); it != shards.end(); ) {
+          if (it->second->count.load(std::memory_order_relaxed) == 0) {
+            it->second->unlink();
+            it = shards.erase(it);
+          } else {
+            ++it;
+          }
+        }
+        sweep_at = std::max<size_t>(16, 2 * shards.size());
+      }
 
-  // Boxes
-  struct Stream;
-  struct MemPool;
-  struct Deviceptr;
+      ~ShardTable() { for (auto & kv : shards) { kv.second->unlink(); } }
+    };
 
-  // Holders
-  using StreamH = std::shared_ptr<Stream>;
-  using MemPoolH = std::shared_ptr<MemPool>;
-  using DeviceptrH = std::shared_ptr<Deviceptr>;
+    // One thread's share of the references to a box. A shard is linked from
+    // its thread's table and from its live holders (while count > 0), and is
+    // deleted when both links are gone.
+    struct alignas(64) Shard
+    {
+      std::atomic<long> count{1};
+      std::atomic<int> links{2};
+      ShardTable const * table;
+      std::shared_ptr<Box> strong;
 
-  template<typename Box> using Cache =
-      std::unordered_map<uintptr_t, std::weak_ptr<Box>>;
+      Shard(std::shared_ptr<Box> const & strong, ShardTable const * table)
+        : table{table}, strong{strong}
+      {}
 
-  // Box definitions
-  struct Stream
-  {
-    CUstream res = CU_STREAM_PER_THREAD;
+      bool try_acquire()
+      {
+        auto n = count.load(std::memory_order_relaxed);
+        while (n != 0) {
+          if (count.compare_exchange_weak(n, n + 1, std::memory_order_relaxed)) {
+            return true;
+          }
+        }
+        return false;
+      }
 
-    static Cache<Stream> cache;
-    static constexpr char const * class_name = "Stream";
-    static constexpr char const * cuda_resource_name = "CUstream";
+      void release()
+      {
+        if (count.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+          strong.reset();
+          unlink();
+        }
+      }
 
-    Stream() = default;
-    Stream(CUstream res) : res{res} {}
+      void unlink()
+      {
+        if (links.fetch_sub(1, std::memory_order_acq_rel) == 1) { delete this; }
+      }
+    };
 
-    uintptr_t as_int() const { return to_uintptr(res); }
+    static ShardTable & local_table()
+    {
+      thread_local ShardTable table;
+      return table;
+    }
 
-    static auto capture(uintptr_t i_res) -> StreamH
+    static Shard * acquire(std::shared_ptr<Box> const & sp)
     {
-      USAGE(streams += 1);
-      MESSAGE("Capturing Stream 0x" << std::hex << i_res);
-      auto res = reinterpret_cast<CUstream>(i_res);
-      return StreamH(new Stream(res), [](auto * box)
-        {
-          USAGE(streams -= 1);
-          MESSAGE("Releasing Stream 0x" << std::hex << box->as_int());
-          auto _ = on_scope_exit([=]{ delete box; });
-          CUDA_CHECK(cuStreamDestroy(box->res));
-        });
+      if (!sp) { return nullptr; }
+      auto & table = local_table();
+      if (table.shards.size() >= table.sweep_at) { table.sweep(); }
+      auto & slot = table.shards[sp.get()];
+      if (slot) {
+        if (slot->try_acquire()) { return slot; }
+        slot->unlink();
+      }
+      slot = new Shard(sp, &table);
+      return slot;
     }
 
-    static auto capture_static(uintptr_t i_res) -> StreamH
+    Shard * shard = nullptr;
+    Box * ptr = nullptr;
+
+  public:
+    using element_type = Box;
+
+    ShardedH() = default;
+    ShardedH(std::nullptr_t) {}
+    ShardedH(std::shared_ptr<Box> const & sp) : shard{acquire(sp)}, ptr{sp.get()} {}
+    explicit ShardedH(Box * p) : ShardedH(std::shared_ptr<Box>(p)) {}
+
+    ShardedH(ShardedH const & other) : shard{other.shard}, ptr{other.ptr}
     {
-      MESSAGE("Wrapping static Stream 0x" << std::hex << i_res);
-      auto res = reinterpret_cast<CUstream>(i_res);
-      return StreamH(new Stream(res));
+      if (!shard) { return; }
+      if (shard->table == &local_table()) {
+        shard->count.fetch_add(1, std::memory_order_relaxed);
+      } else {
+        shard = acquire(shard->strong);
+      }
+    }
+
+    ShardedH(ShardedH && other) noexcept : shard{other.shard}, ptr{other.ptr}
+    {
+      other.shard = nullptr;
+      other.ptr = nullptr;
+    }
+
+    ShardedH & operator=(ShardedH other) noexcept
+    {
+      std::swap(shard, other.shard);
+      std::swap(ptr, other.ptr);
+      return *this;
+    }
+
+    ~ShardedH() { if (shard) { shard->release(); } }
+
+    void reset() { *this = ShardedH{}; }
+    void reset(Box * p) { *this = ShardedH(p); }
+
+    Box * get() const { return ptr; }
+    Box & operator*() const { return *ptr; }
+    Box * operator->() const { return ptr; }
+    explicit operator bool() const { return ptr != nullptr; }
+
+    auto shared() const -> std::shared_ptr<Box>
+    {
+      return shard ? shard->strong : std::shared_ptr<Box>{};
     }
   };
 
-  Cache<Stream> Stream::cache;
+  template<typename Box> class SlotH;
 
-  struct MemPool
+  // Storage for slot-table boxes. See "Slot Holders" above. Slots are
+  // allocated and freed under a mutex; reference counting is lock-free.
+  template<typename Box>
+  class SlotTable
   {
-    CUmemoryPool res = nullptr;
+  public:
+    using Release = void (*)(Box &);
+    static constexpr uint32_t npos = ~uint32_t{0};
 
-    static Cache<MemPool> cache;
-    static constexpr char const * class_name = "MemPool";
-    static constexpr char const * cuda_resource_name = "CUmemoryPool";
+    struct Slot
+    {
+      Box box;
+      std::atomic<uint32_t> refs{0};
+      std::atomic<uint32_t> gen{0}; // written under the mutex, read without it
+      uint32_t index = npos;
+      uint32_t next_free = npos;
+      Release release = nullptr;
+    };
 
-    MemPool() = default;
-    MemPool(CUmemoryPool res) : res{res} {}
+    // Puts a box in a free slot, with a reference count of one, and returns
+    // a holder adopting that reference. The release function, if any, is
+    // called when the last holder is dropped.
+    auto make(Box && box, Release release = nullptr) -> SlotH<Box>
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      uint32_t index = free_head;
+      if (index != npos) {
+        free_head = slot(index).next_free;
+      } else {
+        if (high_water == npos) { throw std::runtime_error("Slot table is full"); }
+        index = high_water++;
+        auto & chunk = chunks[index >> chunk_bits];
+        if (!chunk.load(std::memory_order_relaxed)) {
+          chunk.store(new Slot[chunk_size], std::memory_order_release);
+        }
+      }
+      auto & s = slot(index);
+      s.box = std::move(box);
+      s.index = index;
+      s.release = release;
+      // Publishes the box and generation to lock(), which acquires refs.
+      auto const gen = s.gen.load(std::memory_order_relaxed);
+      s.refs.store(1, std::memory_order_release);
+      live += 1;
+      return SlotH<Box>(index, gen);
+    }
 
-    uintptr_t as_int() const { return to_uintptr(res); }
+    Slot & slot(uint32_t index) const
+    {
+      return chunks[index >> chunk_bits].load(std::memory_order_acquire)[index & chunk_mask];
+    }
 
-    static auto capture(uintptr_t i_res) -> MemPoolH
+    // Returns a holder for the box at (index, gen), or an empty holder if
+    // that slot has since been released.
+    auto lock(uint32_t index, uint32_t gen) -> SlotH<Box>
     {
-      USAGE(mempools += 1);
-      MESSAGE("Capturing MemPool 0x" << std::hex << i_res);
-      auto res = reinterpret_cast<CUmemoryPool>(i_res);
-      return MemPoolH(new MemPool(res), [](auto * box)
-        {
-          USAGE(mempools -= 1);
-          MESSAGE("Releasing MemPool 0x" << std::hex << box->as_int());
-          auto _ = on_scope_exit([=]{ delete box; });
-          CUDA_CHECK(cuMemPoolDestroy(box->res));
-        });
+      if (index == npos) { return {}; }
+      auto * chunk = chunks[index >> chunk_bits].load(std::memory_order_acquire);
+      if (!chunk) { return {}; }
+      auto & s = chunk[index & chunk_mask];
+      auto n = s.refs.load(std::memory_order_relaxed);
+      do {
+        if (n == 0) { return {}; }
+      } while (!s.refs.compare_exchange_weak(n, n + 1, std::memory_order_acquire));
+      if (s.gen.load(std::memory_order_relaxed) != gen) {
+        release(index);
+        return {};
+      }
+      return SlotH<Box>(index, gen);
     }
 
-    static auto capture_static(uintptr_t i_res) -> MemPoolH
+    void acquire(uint32_t index)
     {
-      MESSAGE("Wrapping static MemPool 0x" << std::hex << i_res);
-      auto res = reinterpret_cast<CUmemoryPool>(i_res);
-      return MemPoolH(new MemPool(res));
+      slot(index).refs.fetch_add(1, std::memory_order_relaxed);
     }
-  };
 
-  Cache<MemPool> MemPool::cache;
+    void release(uint32_t index)
+    {
+      auto & s = slot(index);
+      if (s.refs.fetch_sub(1, std::memory_order_acq_rel) != 1) { return; }
+      auto _ = on_scope_exit([&]{ this->free(s); });
+      if (s.release) { s.release(s.box); }
+    }
 
-  struct Deviceptr
+    // Calls action on each live box, in slot order. The table is locked
+    // meanwhile, so the action must not drop holders.
+    template<typename Action>
+    void for_each(Action && action)
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      for (uint32_t i = 0; i < high_water; ++i) {
+        auto & s = slot(i);
+        if (s.refs.load(std::memory_order_acquire) != 0) { action(s.box); }
+      }
+    }
+
+    size_t size() const { return live.load(std::memory_order_relaxed); }
+
+  private:
+    static constexpr uint32_t chunk_bits = 14;
+    static constexpr uint32_t chunk_size = uint32_t{1} << chunk_bits;
+    static constexpr uint32_t chunk_mask = chunk_size - 1;
+    static constexpr size_t max_chunks = size_t{1} << (32 - chunk_bits);
+
+    void free(Slot & s)
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      s.box = Box{};
+      s.release = nullptr;
+      s.gen.store(s.gen.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+      s.next_free = free_head;
+      free_head = s.index;
+      live -= 1;
+    }
+
+    // Chunks are never freed, so that holders outliving the table at exit
+    // still refer to valid memory.
+    std::atomic<Slot *> chunks[max_chunks] = {};
+    std::mutex mutex;
+    uint32_t high_water = 0;
+    uint32_t free_head = npos;
+    std::atomic<size_t> live{0};
+  };
+
+  // A holder for a slot-table box. See "Slot Holders" above.
+  template<typename Box>
+  class SlotH
   {
-    CUdeviceptr res = 0;
-    MemPoolH h_pool;
-    StreamH h_stream;
-    static Cache<Deviceptr> cache;
-    static constexpr char const * class_name = "Deviceptr";
-    static constexpr char const * cuda_resource_name = "CUdeviceptr";
+    using Table = SlotTable<Box>;
 
-    Deviceptr() = default;
-    Deviceptr(
-        CUdeviceptr res
-      , MemPoolH const & h_pool = MemPoolH{}
-      , StreamH const & h_stream = StreamH{}
-      )
-      : res{res}, h_pool{h_pool}, h_stream{h_stream}
-    {}
+    uint32_t index = Table::npos;
+    uint32_t gen = 0;
 
-    uintptr_t as_int() const { return to_uintptr(res); }
+    friend class SlotTable<Box>;
 
-    static auto capture(
-        uintptr_t i_res, MemPoolH const & h_pool, StreamH const & h_stream
-      ) -> DeviceptrH
+    // Adopts a reference already counted in the table.
+    SlotH(uint32_t index, uint32_t gen) : index{index}, gen{gen} {}
+
+  public:
+    using element_type = Box;
+
+    SlotH() = default;
+
+    explicit SlotH(Box * p)
     {
-      USAGE(devptrs += 1);
-      MESSAGE("Capturing Deviceptr 0x" << std::hex << i_res);
-      auto res = static_cast<CUdeviceptr>(i_res);
-      return DeviceptrH(new Deviceptr(res, h_pool, h_stream), [](auto * box)
-        {
-          USAGE(devptrs -= 1);
-          MESSAGE("Releasing Deviceptr 0x" << std::hex << box->as_int());
-          auto _ = on_scope_exit([=]{ delete box; });
-          CUDA_CHECK(cuMemFreeAsync(box->res, box->h_stream->res));
-        });
+      using Slot = typename Table::Slot;
+      static_assert(std::is_standard_layout_v<Slot>);
+      if (!p) { return; }
+      auto const & slot = *reinterpret_cast<Slot const *>(p);
+      index = slot.index;
+      gen = slot.gen.load(std::memory_order_relaxed);
+      Box::table.acquire(index);
     }
 
-    static auto capture_static(uintptr_t i_res) -> DeviceptrH
+    SlotH(SlotH const & other) : index{other.index}, gen{other.gen}
     {
-      MESSAGE("Wrapping static Deviceptr 0x" << std::hex << i_res);
-      auto res = static_cast<CUdeviceptr>(i_res);
-      return DeviceptrH(new Deviceptr(res));
+      if (index != Table::npos) { Box::table.acquire(index); }
+    }
+
+    SlotH(SlotH && other) noexcept : index{other.index}, gen{other.gen}
+    {
+      other.index = Table::npos;
+    }
+
+    SlotH & operator=(SlotH other) noexcept
+    {
+      std::swap(index, other.index);
+      std::swap(gen, other.gen);
+      return *this;
+    }
+
+    ~SlotH() { if (index != Table::npos) { Box::table.release(index); } }
+
+    void reset() { *this = SlotH{}; }
+
+    Box * get() const
+    {
+      return index != Table::npos ? &Box::table.slot(index).box : nullptr;
     }
+
+    Box & operator*() const { return *get(); }
+    Box * operator->() const { return get(); }
+    explicit operator bool() const { return index != Table::npos; }
+
+    uint32_t slot_index() const { return index; }
+    uint32_t generation() const { return gen; }
+
+    // A non-owning reference to a slot, like std::weak_ptr.
+    class Weak
+    {
+      uint32_t index = Table::npos;
+      uint32_t gen = 0;
+
+    public:
+      Weak() = default;
+      Weak(SlotH const & h) : index{h.index}, gen{h.gen} {}
+
+      auto lock() const -> SlotH { return Box::table.lock(index, gen); }
+
+      bool expired() const
+      {
+        if (index == Table::npos) { return true; }
+        // refs first: a reused slot publishes its generation with it.
+        auto const & slot = Box::table.slot(index);
+        return slot.refs.load(std::memory_order_acquire) == 0
+          || slot.gen.load(std::memory_order_relaxed) != gen;
+      }
+    };
   };
 
-  Cache<Deviceptr> Deviceptr::cache;
+  // Devices
+  // =======
 
-  template<typename Box, typename ... Args>
-  auto capture_cached(uintptr_t i_res, Args && ... args)
+  // Number of per-device partitions. Higher ordinals share partitions.
+  constexpr int max_devices = 64;
+
+  size_t device_index(int device) { return static_cast<unsigned>(device) % max_devices; }
+
+  // Returns the device of the current context, or 0 without one.
+  int current_device()
   {
-    using Holder = std::shared_ptr<Box>;
-    auto it = Box::cache.find(i_res);
-    if (it != Box::cache.end()) {
-        auto sp = it->second.lock();
-        if (sp) {
-            MESSAGE("Returning cached " << Box::class_name << " 0x" << std::hex << i_res);
-            return Holder(sp);
-        } else {
-            Box::cache.erase(it);
-        }
+    CUdevice device = 0;
+    auto const result = driver().cuCtxGetDevice(&device);
+    if (result == CUDA_ERROR_INVALID_CONTEXT || result == CUDA_ERROR_NOT_INITIALIZED) {
+      return 0;
     }
+    if (result != CUDA_SUCCESS) { raise_cuda_error(result); }
+    return device;
+  }
 
-    auto sp = Box::capture(i_res, std::forward<Args&&>(args)...);
-    Box::cache[i_res] = std::weak_ptr<Box>(sp);
-    return sp;
+  bool is_default_stream(CUstream stream)
+  {
+    return !stream || stream == CU_STREAM_LEGACY || stream == CU_STREAM_PER_THREAD;
   }
 
-  // Make a Python class wrapping a CUDA resource box that exposes the resource
-  // (as an integer), is showable and resettable, and provided make_static.
-  template<typename Box>
-  auto py_class(py::module & m)
+  int stream_device(CUstream stream)
   {
-    using Holder = std::shared_ptr<Box>;
-    return py::class_<Box, Holder>(m, Box::class_name)
-      .def("__int__", &Box::as_int)
-      .def_property_readonly("value", &Box::as_int)
-      .def("reset", [](Holder & self) { self.reset(new Box{}); })
-      .def("__repr__", [=](Box const & self) {
-          std::ostringstream oss;
-          oss << Box::cuda_resource_name << "=0x" << std::hex << self.as_int();
-          return py::str(oss.str());
-      });
+    // The default streams belong to the current context.
+    if (is_default_stream(stream)) { return current_device(); }
+    CUcontext ctx = nullptr;
+    CUDA_CHECK(driver().cuStreamGetCtx(stream, &ctx));
+    CUDA_CHECK(driver().cuCtxPushCurrent(ctx));
+    auto _ = on_scope_exit([]{ CUcontext popped; driver().cuCtxPopCurrent(&popped); });
+    return current_device();
   }
-}
 
+  // Peer Access
+  // ===========
+  //
+  // Access between devices, enabled on first use and remembered, so that
+  // transfers between a pair of devices make no driver calls once the pair
+  // is set up. Which devices can access which is queried once, for all
+  // pairs. Memory from cuMemAlloc needs context peer access, enabled between
+  // the primary contexts, which are retained for the life of the process.
+  // Memory from a pool needs an access grant on the pool instead, which is
+  // remembered per pool until the pool is released.
+  class PeerAccess
+  {
+  public:
+    // Returns whether device can access memory of peer, enabling context
+    // peer access if needed.
+    bool enable(int device, int peer)
+    {
+      if (device == peer) { return true; }
+      auto & state = pairs[device_index(device)][device_index(peer)];
+      auto current = state.load(std::memory_order_acquire);
+      if (current != unknown) { return current == enabled; }
 
-PYBIND11_MODULE(cuda_core_holders_demo, m)
-{
-  m.doc() = "Provides CUDA resource holders";
+      std::lock_guard<std::mutex> lock(mutex);
+      current = state.load(std::memory_order_relaxed);
+      if (current == unknown) {
+        current = unsupported;
+        if (can_access(device, peer)) {
+          enable_contexts(device, peer);
+          current = enabled;
+        }
+        state.store(current, std::memory_order_release);
+      }
+      return current == enabled;
+    }
 
-  #ifdef ENABLE_DIAGNOSTICS
-  m.def("report_usage", [](){ g_usage.report(); });
-  #endif
+    // Grants peer read-write access to pool, which belongs to owner. Returns
+    // whether peer has access.
+    bool grant(CUmemoryPool pool, int owner, int peer)
+    {
+      if (owner == peer) { return true; }
+      auto const bit = uint64_t(1) << device_index(peer);
+      std::lock_guard<std::mutex> lock(mutex);
+      auto & granted = grants[pool];
+      if (granted & bit) { return true; }
+      if (!can_access(peer, owner)) { return false; }
+      MESSAGE("Granting device " << std::dec << peer << " access to MemPool " << pool);
+      CUmemAccessDesc desc{};
+      desc.location.type = CU_MEM_LOCATION_TYPE_DEVICE;
+      desc.location.id = peer;
+      desc.flags = CU_MEM_ACCESS_FLAGS_PROT_READWRITE;
+      CUDA_CHECK(driver().cuMemPoolSetAccess(pool, &desc, 1));
+      granted |= bit;
+      return true;
+    }
 
-  py_class<Stream>(m)
-    .def_static("capture", &Stream::capture)
-    .def_static("capture_static", &Stream::capture_static)
-    ;
+    // Forgets the grants of a released pool, whose handle may be reused.
+    void forget(CUmemoryPool pool)
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      grants.erase(pool);
+    }
 
-  py_class<MemPool>(m)
-    .def_static("capture", &MemPool::capture)
-    .def_static("capture_cached", (MemPoolH(*)(uintptr_t)) &capture_cached<MemPool>)
-    .def_static("capture_static", &MemPool::capture_static)
-    ;
+  private:
+    enum State : uint8_t { unknown, unsupported, enabled };
 
-  py_class<Deviceptr>(m)
-    .def_static("capture", &Deviceptr::capture)
-    .def_static("capture_static", &Deviceptr::capture_static)
-    .def("set_stream", [](DeviceptrH const & h_devp, StreamH const & h_stream)
-        { h_devp->h_stream = h_stream; })
-    ;
+    // Call with the mutex locked.
+    bool can_access(int device, int peer)
+    {
+      if (topology.empty()) {
+        CUDA_CHECK(driver().cuDeviceGetCount(&ndevices));
+        topology.resize(ndevices * ndevices);
+        for (int i = 0; i < ndevices; ++i) {
+          for (int j = 0; j < ndevices; ++j) {
+            int can = i == j;
+            if (i != j) { CUDA_CHECK(driver().cuDeviceCanAccessPeer(&can, cu_device(i), cu_device(j))); }
+            topology[i * ndevices + j] = can;
+          }
+        }
+      }
+      if (device >= ndevices || peer >= ndevices) { return false; }
+      return topology[device * ndevices + peer];
+    }
+
+    // Call with the mutex locked.
+    void enable_contexts(int device, int peer)
+    {
+      MESSAGE("Enabling peer access from device " << std::dec << device << " to " << peer);
+      auto const peer_ctx = primary_context(peer);
+      CUDA_CHECK(driver().cuCtxPushCurrent(primary_context(device)));
+      auto _ = on_scope_exit([]{ CUcontext popped; driver().cuCtxPopCurrent(&popped); });
+      auto const result = driver().cuCtxEnablePeerAccess(peer_ctx, 0);
+      if (result != CUDA_SUCCESS && result != CUDA_ERROR_PEER_ACCESS_ALREADY_ENABLED) {
+        raise_cuda_error(result);
+      }
+    }
+
+    CUcontext primary_context(int device)
+    {
+      auto & ctx = contexts[device];
+      if (!ctx) { CUDA_CHECK(driver().cuDevicePrimaryCtxRetain(&ctx, cu_device(device))); }
+      return ctx;
+    }
+
+    static CUdevice cu_device(int ordinal)
+    {
+      CUdevice device = 0;
+      CUDA_CHECK(driver().cuDeviceGet(&device, ordinal));
+      return device;
+    }
+
+    std::mutex mutex;
+    std::atomic<State> pairs[max_devices][max_devices] = {};
+    int ndevices = 0;
+    std::vector<char> topology;
+    std::map<int, CUcontext> contexts;
+    std::unordered_map<CUmemoryPool, uint64_t> grants;
+  } g_peers;
+
+  #ifdef ENABLE_DIAGNOSTICS
+  static struct CudaResourceUsage
+  {
+    // Counts for one device, on their own cache line. Atomic, since
+    // deleters may run on the completion thread.
+    struct alignas(64) Counts
+    {
+      std::atomic<int> streams{0};
+      std::atomic<int> mempools{0};
+      std::atomic<int> devptrs{0};
+    };
+
+    Counts devices[max_devices];
+
+    Counts & on(int device) { return devices[device_index(device)]; }
+
+    // Returns the counts for one device, or summed over all devices.
+    auto counts(std::optional<int> device = {}) -> std::map<std::string, int>
+    {
+      std::map<std::string, int> result{{"streams", 0}, {"mempools", 0}, {"devptrs", 0}};
+      for (int i = 0; i < max_devices; ++i) {
+        if (device && device_index(*device) != size_t(i)) { continue; }
+        result["streams"] += devices[i].streams;
+        result["mempools"] += devices[i].mempools;
+        result["devptrs"] += devices[i].devptrs;
+      }
+      return result;
+    }
+
+    // Front cache lookups. Counted per thread, so that counting does not
+    // share cache lines between threads, and summed when reported.
+    struct FrontCacheCounters
+    {
+      std::atomic<long> hits{0};
+      std::atomic<long> misses{0};
+      std::atomic<long> invalidations{0};
+
+      // Only the owning thread writes, so no read-modify-write is needed.
+      static void bump(std::atomic<long> & n)
+      {
+        n.store(n.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+      }
+
+      void hit() { bump(hits); }
+      void miss() { bump(misses); }
+      void invalidation() { bump(invalidations); }
+
+      void add_to(std::map<std::string, long> & totals) const
+      {
+        totals["hits"] += hits.load(std::memory_order_relaxed);
+        totals["misses"] += misses.load(std::memory_order_relaxed);
+        totals["invalidations"] += invalidations.load(std::memory_order_relaxed);
+      }
+    };
+
+    std::mutex front_cache_mutex;
+    std::vector<FrontCacheCounters const *> front_cache_threads;
+    std::map<std::string, long> front_cache_retired;
+
+    FrontCacheCounters & front_cache()
+    {
+      struct Registration
+      {
+        CudaResourceUsage * usage;
+        FrontCacheCounters counters;
+
+        Registration(CudaResourceUsage * usage) : usage{usage}
+        {
+          std::lock_guard<std::mutex> lock(usage->front_cache_mutex);
+          usage->front_cache_threads.push_back(&counters);
+        }
+
+        ~Registration()
+        {
+          std::lock_guard<std::mutex> lock(usage->front_cache_mutex);
+          counters.add_to(usage->front_cache_retired);
+          auto & threads = usage->front_cache_threads;
+          threads.erase(std::find(threads.begin(), threads.end(), &counters));
+        }
+      };
+      thread_local Registration registration(this);
+      return registration.counters;
+    }
+
+    // Elapsed GPU time of timed stream regions, by label, in power-of-two
+    // microsecond buckets: bucket i counts times in [2^i, 2^(i+1)) us, with
+    // shorter times in bucket 0 and longer ones in the last.
+    struct Histogram
+    {
+      long count = 0;
+      double total_ms = 0;
+      double min_ms = 0;
+      double max_ms = 0;
+      std::array<long, 32> buckets{};
+
+      void add(float ms)
+      {
+        min_ms = count ? std::min<double>(min_ms, ms) : ms;
+        max_ms = count ? std::max<double>(max_ms, ms) : ms;
+        count += 1;
+        total_ms += ms;
+        size_t i = 0;
+        for (double us = ms * 1000; us >= 2 && i + 1 < buckets.size(); us /= 2) { ++i; }
+        buckets[i] += 1;
+      }
+    };
+
+    std::mutex timings_mutex;
+    std::map<std::string, Histogram> timings;
+
+    void record_timing(std::string const & label, float ms)
+    {
+      std::lock_guard<std::mutex> lock(timings_mutex);
+      timings[label].add(ms);
+    }
+
+    auto timing_histograms() -> std::map<std::string, Histogram>
+    {
+      std::lock_guard<std::mutex> lock(timings_mutex);
+      return timings;
+    }
+
+    auto front_cache_totals() -> std::map<std::string, long>
+    {
+      std::lock_guard<std::mutex> lock(front_cache_mutex);
+      auto totals = front_cache_retired;
+      for (auto const * counters : front_cache_threads) { counters->add_to(totals); }
+      return totals;
+    }
+
+    void report()
+    {
+      auto total = this->counts();
+      auto front = this->front_cache_totals();
+      std::cerr << std::dec << "\n"
+                   "CUDA Core Resource Usage Report\n"
+                   "===============================\n"
+                   "Currently in use:\n"
+                << "    #streams : " << total["streams"]  << "\n"
+                << "    #mempools: " << total["mempools"] << "\n"
+                << "    #devptrs : " << total["devptrs"]  << "\n"
+      ;
+      for (int i = 0; i < max_devices; ++i) {
+        auto const & c = devices[i];
+        if (!c.streams && !c.mempools && !c.devptrs) { continue; }
+        std::cerr << "    device " << i << ": " << c.streams << " streams, "
+                  << c.mempools << " mempools, " << c.devptrs << " devptrs\n";
+      }
+      std::cerr << "Front cache:\n"
+                << "    #hits         : " << front["hits"] << "\n"
+                << "    #misses       : " << front["misses"] << "\n"
+                << "    #invalidations: " << front["invalidations"] << "\n"
+      ;
+      auto const histograms = this->timing_histograms();
+      if (!histograms.empty()) { std::cerr << "GPU timings:\n"; }
+      for (auto const & [label, h] : histograms) {
+        std::cerr << "    " << label << ": " << h.count << " x, mean "
+                  << h.total_ms / h.count << " ms, min " << h.min_ms
+                  << " ms, max " << h.max_ms << " ms\n";
+      }
+    }
+
+    ~CudaResourceUsage() { this->report(); }
+  } g_usage;
+  #endif
+
+  // Boxes
+  struct Stream;
+  struct MemPool;
+  struct Deviceptr;
+  struct SlotDeviceptr;
+  struct SpillableDeviceptr;
+  struct ManagedPtr;
+  struct GraphExec;
+  struct Event;
+  struct DeviceptrSlice;
+  struct HostRegistration;
+
+  // Holders
+  using StreamH = std::shared_ptr<Stream>;
+  using MemPoolH = std::shared_ptr<MemPool>;
+  using DeviceptrH = std::shared_ptr<Deviceptr>;
+  using SlotDeviceptrH = SlotH<SlotDeviceptr>;
+  using SpillableDeviceptrH = std::shared_ptr<SpillableDeviceptr>;
+  using ManagedPtrH = std::shared_ptr<ManagedPtr>;
+  using GraphExecH = std::shared_ptr<GraphExec>;
+  using EventH = std::shared_ptr<Event>;
+  using DeviceptrSliceH = SlotH<DeviceptrSlice>;
+  using HostRegistrationH = std::shared_ptr<HostRegistration>;
+
+  // Sharded holders, for hot owners
+  using StreamSH = ShardedH<Stream>;
+  using MemPoolSH = ShardedH<MemPool>;
+
+  // Registry of the live holders of one box type, by device and handle. Each
+  // device has its own partition, allocated on first use, split into shards,
+  // each with its own lock, so that captures of different handles rarely
+  // contend. Entries are weak, and are erased by the deleter.
+  //
+  // The device of a pool, event or graph is the one it is captured as, and
+  // finding a stream's device takes several driver calls, so lookups do not
+  // resolve the device: they look for the handle in the same shard of every
+  // partition allocated so far. Inserts take a lock shared by all partitions
+  // for the handle's shard, look again, and only then resolve the device.
+  //
+  // In front of the shards, each thread has a small direct-mapped cache of
+  // the holders it was recently returned. Its entries are validated by
+  // locking their weak reference (for slot holders, by slot generation), so
+  // hits touch no shared state besides the holder itself, and stale entries
+  // are dropped when found.
+  template<typename Box, typename Weak = std::weak_ptr<Box>>
+  class Cache
+  {
+    static constexpr size_t nshards = 64;
+    static constexpr size_t front_size = 64;
+
+    struct alignas(64) Shard
+    {
+      std::mutex mutex;
+      std::unordered_map<uintptr_t, Weak> entries;
+    };
+
+    struct Partition
+    {
+      Shard shards[nshards];
+    };
+
+    std::atomic<Partition *> partitions[max_devices] = {};
+
+    struct alignas(64) InsertLock
+    {
+      std::mutex mutex;
+    };
+
+    InsertLock insert_locks[nshards];
+
+    Partition & partition(int device)
+    {
+      auto & slot = partitions[device_index(device)];
+      if (auto * p = slot.load(std::memory_order_acquire)) { return *p; }
+      auto fresh = std::make_unique<Partition>();
+      Partition * current = nullptr;
+      if (slot.compare_exchange_strong(current, fresh.get(), std::memory_order_acq_rel)) {
+        return *fresh.release();
+      }
+      return *current;
+    }
+
+    // Handles are aligned and often a fixed stride apart, so drop the
+    // alignment bits and fold in the higher bits before indexing.
+    static size_t mix(uintptr_t key) { return (key >> 4) ^ (key >> 10) ^ (key >> 16); }
+
+    Shard & shard(uintptr_t key, int device)
+    {
+      return partition(device).shards[mix(key) % nshards];
+    }
+
+    static auto find(Shard & s, uintptr_t key) -> decltype(std::declval<Weak>().lock())
+    {
+      std::lock_guard<std::mutex> lock(s.mutex);
+      auto it = s.entries.find(key);
+      if (it == s.entries.end()) { return {}; }
+      return it->second.lock();
+    }
+
+    // Looks for key in shard index of every partition.
+    auto find_any(size_t index, uintptr_t key) -> decltype(std::declval<Weak>().lock())
+    {
+      for (auto & slot : partitions) {
+        auto * p = slot.load(std::memory_order_acquire);
+        if (!p) { continue; }
+        if (auto h = find(p->shards[index], key)) { return h; }
+      }
+      return {};
+    }
+
+    struct FrontEntry
+    {
+      Cache const * owner = nullptr;
+      uintptr_t key = 0;
+      Weak weak;
+    };
+
+    FrontEntry & front_entry(uintptr_t key) const
+    {
+      thread_local std::array<FrontEntry, front_size> front;
+      return front[mix(key) % front_size];
+    }
+
+  public:
+    using Holder = decltype(std::declval<Weak>().lock());
+
+    Cache() = default;
+    Cache(Cache const &) = delete;
+    Cache & operator=(Cache const &) = delete;
+
+    ~Cache()
+    {
+      for (auto & p : partitions) { delete p.load(); }
+    }
+
+    // Returns the live holder for key, or else the holder returned by
+    // make(device), which is registered. device_of() returns the device of
+    // key. It is only called when key is not registered.
+    template<typename DeviceOf, typename Make>
+    auto find_or_insert(uintptr_t key, DeviceOf && device_of, Make && make) -> Holder
+    {
+      auto & front = front_entry(key);
+      if (front.owner == this && front.key == key) {
+        if (auto h = front.weak.lock()) {
+          USAGE(front_cache().hit());
+          MESSAGE("Returning cached " << Box::class_name << " 0x" << std::hex << key);
+          return h;
+        }
+        USAGE(front_cache().invalidation());
+        front = FrontEntry{};
+      } else {
+        USAGE(front_cache().miss());
+      }
+
+      auto h = [&]
+        {
+          auto const index = mix(key) % nshards;
+          if (auto h = find_any(index, key)) {
+            MESSAGE("Returning cached " << Box::class_name << " 0x" << std::hex << key);
+            return h;
+          }
+
+          std::lock_guard<std::mutex> insert_lock(insert_locks[index].mutex);
+          if (auto h = find_any(index, key)) {
+            MESSAGE("Returning cached " << Box::class_name << " 0x" << std::hex << key);
+            return h;
+          }
+          int const device = device_of();
+          auto h = make(device);
+          auto & s = partition(device).shards[index];
+          std::lock_guard<std::mutex> lock(s.mutex);
+          s.entries[key] = Weak(h);
+          return h;
+        }();
+      front = FrontEntry{this, key, Weak(h)};
+      return h;
+    }
+
+    // Returns holders for the live entries of one device, or of all devices.
+    auto live(std::optional<int> device = {}) -> std::vector<Holder>
+    {
+      std::vector<Holder> holders;
+      for (int i = 0; i < max_devices; ++i) {
+        if (device && device_index(*device) != size_t(i)) { continue; }
+        auto * p = partitions[i].load(std::memory_order_acquire);
+        if (!p) { continue; }
+        for (auto & s : p->shards) {
+          std::lock_guard<std::mutex> lock(s.mutex);
+          for (auto const & kv : s.entries) {
+            if (auto h = kv.second.lock()) { holders.push_back(std::move(h)); }
+          }
+        }
+      }
+      return holders;
+    }
+
+    // Erases the entry for key unless it was replaced by a live holder.
+    // Returns whether key has a live holder, without taking a reference.
+    bool contains(uintptr_t key)
+    {
+      for (auto & slot : partitions) {
+        auto * p = slot.load(std::memory_order_acquire);
+        if (!p) { continue; }
+        auto & s = p->shards[mix(key) % nshards];
+        std::lock_guard<std::mutex> lock(s.mutex);
+        auto it = s.entries.find(key);
+        if (it != s.entries.end() && !it->second.expired()) { return true; }
+      }
+      return false;
+    }
+
+    void erase_expired(uintptr_t key, int device)
+    {
+      auto & s = shard(key, device);
+      std::lock_guard<std::mutex> lock(s.mutex);
+      auto it = s.entries.find(key);
+      if (it != s.entries.end() && it->second.expired()) { s.entries.erase(it); }
+    }
+  };
+
+  // Box definitions
+  struct Stream
+  {
+    CUstream res = CU_STREAM_PER_THREAD;
+    int device = 0;
+
+    static Cache<Stream> cache;
+    static constexpr char const * class_name = "Stream";
+    static constexpr char const * cuda_resource_name = "CUstream";
+
+    Stream() = default;
+    Stream(CUstream res, int device = 0) : res{res}, device{device} {}
+
+    uintptr_t as_int() const { return to_uintptr(res); }
+
+    // Registers a function to call with each captured stream before it is
+    // destroyed, e.g. to drop resources bound to it.
+    static void on_release(void (*hook)(Stream const &))
+    {
+      std::lock_guard<std::mutex> lock(release_hooks_mutex);
+      release_hooks.push_back(hook);
+    }
+
+    static auto capture(uintptr_t i_res) -> StreamH
+    {
+      auto res = reinterpret_cast<CUstream>(i_res);
+      return cache.find_or_insert(i_res, [&]{ return stream_device(res); }, [&](int device)
+        {
+          USAGE(on(device).streams += 1);
+          MESSAGE("Capturing Stream 0x" << std::hex << i_res);
+          return StreamH(new Stream(res, device), [](auto * box)
+            {
+              USAGE(on(box->device).streams -= 1);
+              MESSAGE("Releasing Stream 0x" << std::hex << box->as_int());
+              auto _ = on_scope_exit([=]{ delete box; });
+              cache.erase_expired(box->as_int(), box->device);
+              run_release_hooks(*box);
+              CUDA_CHECK(driver().cuStreamDestroy(box->res));
+            });
+        });
+    }
+
+    static auto capture_static(uintptr_t i_res) -> StreamH
+    {
+      MESSAGE("Wrapping static Stream 0x" << std::hex << i_res);
+      auto res = reinterpret_cast<CUstream>(i_res);
+      return StreamH(new Stream(res, current_device()));
+    }
+
+  private:
+    static void run_release_hooks(Stream const & box)
+    {
+      std::vector<void (*)(Stream const &)> hooks;
+      {
+        std::lock_guard<std::mutex> lock(release_hooks_mutex);
+        hooks = release_hooks;
+      }
+      for (auto hook : hooks) { hook(box); }
+    }
+
+    static std::mutex release_hooks_mutex;
+    static std::vector<void (*)(Stream const &)> release_hooks;
+  };
+
+  Cache<Stream> Stream::cache;
+  std::mutex Stream::release_hooks_mutex;
+  std::vector<void (*)(Stream const &)> Stream::release_hooks;
+
+  struct MemPool
+  {
+    CUmemoryPool res = nullptr;
+    int device = 0;
+
+    static Cache<MemPool> cache;
+    static constexpr char const * class_name = "MemPool";
+    static constexpr char const * cuda_resource_name = "CUmemoryPool";
+
+    MemPool() = default;
+    MemPool(CUmemoryPool res, int device = 0) : res{res}, device{device} {}
+
+    uintptr_t as_int() const { return to_uintptr(res); }
+
+    static auto capture(uintptr_t i_res) -> MemPoolH
+    {
+      return capture(i_res, current_device());
+    }
+
+    static auto capture(uintptr_t i_res, int device) -> MemPoolH
+    {
+      return cache.find_or_insert(i_res, [=]{ return device; }, [&](int device)
+        {
+          USAGE(on(device).mempools += 1);
+          MESSAGE("Capturing MemPool 0x" << std::hex << i_res);
+          auto res = reinterpret_cast<CUmemoryPool>(i_res);
+          return MemPoolH(new MemPool(res, device), [](auto * box)
+            {
+              USAGE(on(box->device).mempools -= 1);
+              MESSAGE("Releasing MemPool 0x" << std::hex << box->as_int());
+              auto _ = on_scope_exit([=]{ delete box; });
+              cache.erase_expired(box->as_int(), box->device);
+              g_peers.forget(box->res);
+              CUDA_CHECK(driver().cuMemPoolDestroy(box->res));
+            });
+        });
+    }
+
+    static auto capture_static(uintptr_t i_res) -> MemPoolH
+    {
+      MESSAGE("Wrapping static MemPool 0x" << std::hex << i_res);
+      auto res = reinterpret_cast<CUmemoryPool>(i_res);
+      return MemPoolH(new MemPool(res, current_device()));
+    }
+  };
+
+  Cache<MemPool> MemPool::cache;
+
+  struct Event
+  {
+    CUevent res = nullptr;
+    int device = 0;
+
+    static Cache<Event> cache;
+    static constexpr char const * class_name = "Event";
+    static constexpr char const * cuda_resource_name = "CUevent";
+
+    Event() = default;
+    Event(CUevent res, int device = 0) : res{res}, device{device} {}
+
+    uintptr_t as_int() const { return to_uintptr(res); }
+
+    void record(Stream const & stream) const { CUDA_CHECK(driver().cuEventRecord(res, stream.res)); }
+
+    static auto capture(uintptr_t i_res) -> EventH
+    {
+      return cache.find_or_insert(i_res, [&]{ return current_device(); }, [&](int device)
+        {
+          MESSAGE("Capturing Event 0x" << std::hex << i_res);
+          auto res = reinterpret_cast<CUevent>(i_res);
+          return EventH(new Event(res, device), [](auto * box)
+            {
+              MESSAGE("Releasing Event 0x" << std::hex << box->as_int());
+              auto _ = on_scope_exit([=]{ delete box; });
+              cache.erase_expired(box->as_int(), box->device);
+              CUDA_CHECK(driver().cuEventDestroy(box->res));
+            });
+        });
+    }
+
+    static auto capture_static(uintptr_t i_res) -> EventH
+    {
+      MESSAGE("Wrapping static Event 0x" << std::hex << i_res);
+      auto res = reinterpret_cast<CUevent>(i_res);
+      return EventH(new Event(res, current_device()));
+    }
+  };
+
+  Cache<Event> Event::cache;
+
+  // Host Registrations
+  // ==================
+  //
+  // cuMemHostRegister page-locks host memory, which is expensive, so
+  // registrations are cached by address range. Ranges are widened to whole
+  // pages, since two registrations cannot share a page. A range within a live
+  // registration returns that registration. A range overlapping live
+  // registrations registers only the pages they leave uncovered, and returns
+  // a view holding all of the registrations that together cover it. Since
+  // the driver refuses overlapping registrations, overlapping one registered
+  // with other flags is an error. Memory is unregistered when the last holder
+  // of its registration is dropped. The caller keeps the memory itself alive
+  // meanwhile, unless it registered a Python buffer, whose export the
+  // returned view holds.
+  struct HostRegistration
+  {
+    void * res = nullptr;
+    size_t size = 0;
+    unsigned int flags = 0;
+    int device = 0;
+    std::shared_ptr<Py_buffer> exported; // of a view of a Python buffer
+    std::vector<HostRegistrationH> parts; // of a view, the registrations covering it
+
+    static constexpr char const * class_name = "HostRegistration";
+    static constexpr char const * cuda_resource_name = "hostptr";
+
+    HostRegistration() = default;
+    HostRegistration(void * res, size_t size, unsigned int flags, int device)
+      : res{res}, size{size}, flags{flags}, device{device} {}
+
+    uintptr_t as_int() const { return to_uintptr(res); }
+
+    uintptr_t begin() const { return as_int(); }
+    uintptr_t end() const { return as_int() + size; }
+
+    static auto acquire(uintptr_t addr, size_t size, unsigned int flags) -> HostRegistrationH
+    {
+      if (size == 0) { throw std::invalid_argument("Cannot register an empty host range"); }
+      auto const page = static_cast<uintptr_t>(sysconf(_SC_PAGESIZE));
+      auto const begin = addr / page * page;
+      auto const end = (addr + size + page - 1) / page * page;
+
+      // Destroyed after the lock is released, since deleters take it
+      std::vector<HostRegistrationH> parts;
+      std::lock_guard<std::mutex> lock(mutex);
+
+      auto it = registry.upper_bound(begin);
+      if (it != registry.begin() && std::prev(it)->second.end > begin) { --it; }
+      auto at = begin;
+      while (it != registry.end() && it->first < end) {
+        auto h_reg = it->second.owner.lock();
+        if (!h_reg) {
+          // Its deleter is waiting for the lock, and will find it gone
+          unregister(it->first);
+          it = registry.erase(it);
+          continue;
+        }
+        auto const reg_begin = it->first;
+        parts.push_back(std::move(h_reg));
+        if (parts.back()->flags != flags) {
+          std::ostringstream message;
+          message << "Host memory at 0x" << std::hex << reg_begin
+                  << " is already registered with flags 0x" << parts.back()->flags;
+          throw std::invalid_argument(message.str());
+        }
+        if (reg_begin > at) { parts.insert(parts.end() - 1, make(at, reg_begin, flags)); }
+        at = it->second.end;
+        ++it;
+      }
+      if (at < end) { parts.push_back(make(at, end, flags)); }
+
+      if (parts.size() == 1) { return parts.front(); }
+      MESSAGE("Covering host memory 0x" << std::hex << begin << " with " << std::dec << parts.size() << " registrations");
+      auto h_view = std::make_shared<HostRegistration>(reinterpret_cast<void *>(begin), end - begin, flags, parts.front()->device);
+      h_view->parts = std::move(parts);
+      return h_view;
+    }
+
+    // Returns a view of h holding exported, an export of the buffer h
+    // registers. Its parts are released first, so that memory is
+    // unregistered before the buffer may be freed.
+    static auto holding(HostRegistrationH h, std::shared_ptr<Py_buffer> exported) -> HostRegistrationH
+    {
+      auto h_view = std::make_shared<HostRegistration>(h->res, h->size, h->flags, h->device);
+      h_view->parts = h->parts.empty() ? std::vector<HostRegistrationH>{std::move(h)} : h->parts;
+      h_view->exported = std::move(exported);
+      return h_view;
+    }
+
+    // The address and size of each live registration, in address order.
+    static auto registered() -> std::vector<std::pair<uintptr_t, size_t>>
+    {
+      std::vector<std::pair<uintptr_t, size_t>> result;
+      std::lock_guard<std::mutex> lock(mutex);
+      for (auto const & [begin, entry] : registry) {
+        if (!entry.owner.expired()) { result.emplace_back(begin, entry.end - begin); }
+      }
+      return result;
+    }
+
+  private:
+    struct Entry
+    {
+      uintptr_t end = 0;
+      std::weak_ptr<HostRegistration> owner;
+      HostRegistration const * box = nullptr;
+    };
+    using Ranges = std::map<uintptr_t, Entry>;
+
+    static std::mutex mutex;
+    static Ranges registry;
+
+    static void unregister(uintptr_t begin)
+    {
+      MESSAGE("Unregistering host memory 0x" << std::hex << begin);
+      CUDA_CHECK(driver().cuMemHostUnregister(reinterpret_cast<void *>(begin)));
+    }
+
+    // Registers [begin, end), which no live registration overlaps. Called
+    // with the lock held.
+    static auto make(uintptr_t begin, uintptr_t end, unsigned int flags) -> HostRegistrationH
+    {
+      MESSAGE("Registering host memory 0x" << std::hex << begin << "-0x" << end);
+      auto box = std::make_unique<HostRegistration>(reinterpret_cast<void *>(begin), end - begin, flags, current_device());
+      CUDA_CHECK(driver().cuMemHostRegister(box->res, box->size, flags));
+      auto h_reg = HostRegistrationH(box.release(), [](auto * box)
+        {
+          auto _ = on_scope_exit([=]{ delete box; });
+          std::lock_guard<std::mutex> lock(mutex);
+          auto it = registry.find(box->begin());
+          if (it == registry.end() || it->second.box != box) { return; }
+          registry.erase(it);
+          unregister(box->begin());
+        });
+      registry[begin] = Entry{end, h_reg, h_reg.get()};
+      return h_reg;
+    }
+  };
+
+  std::mutex HostRegistration::mutex;
+  HostRegistration::Ranges HostRegistration::registry;
+  // Reclaim Chain
+  // =============
+  //
+  // When an allocation fails with CUDA_ERROR_OUT_OF_MEMORY, the enabled
+  // stages of the reclaim chain run in order, each followed by a retry, until
+  // the allocation succeeds. Only then is the error raised. Stages:
+  //
+  //   - flush_deferred
+  //       Runs the registered flushers of deferred frees.
+  //
+  //   - spill
+  //       Spills every resident spillable buffer of the allocating pool to
+  //       host memory.
+  //
+  //   - trim_pools
+  //       Synchronizes the allocating stream, so that its pending frees
+  //       complete, and trims every captured memory pool of its device.
+  //
+  //   - gc
+  //       Runs a Python garbage collection pass, to drop holders that are
+  //       only reachable from unreachable cycles, and synchronizes the
+  //       allocating stream. Disabled by default.
+  class ReclaimChain
+  {
+  public:
+    struct Stage
+    {
+      char const * name;
+      void (*action)(MemPool const & pool, Stream const & stream);
+      std::atomic<bool> enabled;
+      std::atomic<long> attempts{0};
+      std::atomic<long> recoveries{0};
+    };
+
+    // Calls alloc, retrying after each enabled stage while it reports that
+    // memory is exhausted. Returns the result of the last call.
+    template<typename Alloc>
+    CUresult allocate(Alloc && alloc, MemPool const & pool, Stream const & stream)
+    {
+      auto result = alloc();
+      if (result != CUDA_ERROR_OUT_OF_MEMORY) { return result; }
+      for (auto & stage : stages) {
+        if (!stage.enabled) { continue; }
+        MESSAGE("Out of memory, reclaiming with " << stage.name);
+        stage.attempts += 1;
+        stage.action(pool, stream);
+        result = alloc();
+        if (result != CUDA_ERROR_OUT_OF_MEMORY) {
+          if (result == CUDA_SUCCESS) { stage.recoveries += 1; }
+          return result;
+        }
+      }
+      failures += 1;
+      return result;
+    }
+
+    // Registers a function that performs deferred frees when memory runs out.
+    void add_flusher(std::function<void()> flusher)
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      flushers.push_back(std::move(flusher));
+    }
+
+    void set_enabled(std::vector<std::string> const & names)
+    {
+      for (auto const & name : names) { find(name); }
+      for (auto & stage : stages) {
+        stage.enabled = std::find(names.begin(), names.end(), stage.name) != names.end();
+      }
+    }
+
+    auto enabled() const -> std::vector<std::string>
+    {
+      std::vector<std::string> names;
+      for (auto const & stage : stages) {
+        if (stage.enabled) { names.push_back(stage.name); }
+      }
+      return names;
+    }
+
+    auto stats() const -> std::map<std::string, long>
+    {
+      std::map<std::string, long> result{{"failures", failures.load()}};
+      for (auto const & stage : stages) {
+        result[std::string(stage.name) + ".attempts"] = stage.attempts.load();
+        result[std::string(stage.name) + ".recoveries"] = stage.recoveries.load();
+      }
+      return result;
+    }
+
+  private:
+    Stage & find(std::string const & name)
+    {
+      for (auto & stage : stages) {
+        if (name == stage.name) { return stage; }
+      }
+      throw std::invalid_argument("No reclaim stage named " + name);
+    }
+
+    static void flush_deferred(MemPool const &, Stream const &);
+    static void spill(MemPool const & pool, Stream const &);
+
+    static void trim_pools(MemPool const & pool, Stream const & stream)
+    {
+      CUDA_CHECK(driver().cuStreamSynchronize(stream.res));
+      for (auto const & h_pool : MemPool::cache.live(pool.device)) {
+        CUDA_CHECK(driver().cuMemPoolTrimTo(h_pool->res, 0));
+      }
+    }
+
+    static void collect_garbage(MemPool const &, Stream const & stream)
+    {
+      {
+        py::gil_scoped_acquire gil;
+        py::module_::import("gc").attr("collect")();
+      }
+      CUDA_CHECK(driver().cuStreamSynchronize(stream.res));
+    }
+
+    Stage stages[4] = {
+        {"flush_deferred", &flush_deferred, true}
+      , {"spill", &spill, true}
+      , {"trim_pools", &trim_pools, true}
+      , {"gc", &collect_garbage, false}
+      };
+    std::atomic<long> failures{0};
+    std::mutex mutex;
+    std::vector<std::function<void()>> flushers;
+  } g_reclaim;
+
+  void ReclaimChain::flush_deferred(MemPool const &, Stream const &)
+  {
+    std::vector<std::function<void()>> flushers;
+    {
+      std::lock_guard<std::mutex> lock(g_reclaim.mutex);
+      flushers = g_reclaim.flushers;
+    }
+    for (auto const & flush : flushers) { flush(); }
+  }
+
+  // Owner Index
+  // ===========
+  //
+  // An optional index from device addresses to the live Deviceptr whose
+  // allocation contains them, to attach ownership to interior pointers, e.g.
+  // returned by kernels or other libraries. Allocations are indexed when
+  // captured with their size while the index is enabled.
+  //
+  // Lookups take no lock. The index is an immutable snapshot, replaced on
+  // each change: ranges sorted by address, plus a log of the changes since
+  // they were sorted, so that a change copies the log rather than every
+  // range. The ranges are re-sorted once the log is full. Replaced snapshots
+  // are freed by a later change that finds no lookup in progress.
+  class OwnerIndex
+  {
+  public:
+    ~OwnerIndex()
+    {
+      delete current.load();
+      for (auto const * snapshot : retired) { delete snapshot; }
+    }
+
+    bool enabled() const { return on.load(std::memory_order_relaxed); }
+
+    // Disabling keeps allocations indexed until they are released.
+    void set_enabled(bool enabled) { on.store(enabled, std::memory_order_relaxed); }
+
+    void insert(DeviceptrH const & h_devp, CUdeviceptr res, size_t size)
+    {
+      change({res, res + size, h_devp, false});
+    }
+
+    void erase(CUdeviceptr res, size_t size) { change({res, res + size, {}, true}); }
+
+    // Returns the holder of the allocation containing addr, if indexed.
+    auto find(CUdeviceptr addr) const -> DeviceptrH
+    {
+      readers.fetch_add(1);
+      auto _ = on_scope_exit([this]{ readers.fetch_sub(1); });
+      auto const * snapshot = current.load();
+      if (!snapshot) { return {}; }
+      // Live ranges are disjoint, so the latest change covering addr decides.
+      for (auto it = snapshot->log.rbegin(); it != snapshot->log.rend(); ++it) {
+        if (it->begin <= addr && addr < it->end) {
+          return it->removed ? DeviceptrH{} : it->owner.lock();
+        }
+      }
+      auto const & ranges = *snapshot->ranges;
+      auto it = std::upper_bound(ranges.begin(), ranges.end(), addr, [](auto addr, auto const & range)
+        {
+          return addr < range.begin;
+        });
+      if (it == ranges.begin() || addr >= std::prev(it)->end) { return {}; }
+      return std::prev(it)->owner.lock();
+    }
+
+  private:
+    static constexpr size_t max_log = 64;
+
+    struct Range
+    {
+      CUdeviceptr begin;
+      CUdeviceptr end;
+      std::weak_ptr<Deviceptr> owner;
+      bool removed;
+    };
+
+    struct Snapshot
+    {
+      std::shared_ptr<std::vector<Range> const> ranges;
+      std::vector<Range> log;
+    };
+
+    void change(Range && range)
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      auto const * previous = current.load();
+      auto next = std::make_unique<Snapshot>();
+      if (!previous) {
+        next->ranges = std::make_shared<std::vector<Range> const>();
+      } else if (previous->log.size() < max_log) {
+        *next = *previous;
+      } else {
+        next->ranges = merge(*previous);
+      }
+      next->log.push_back(std::move(range));
+
+      retired.push_back(current.exchange(next.release()));
+      if (readers.load() == 0) {
+        for (auto const * snapshot : retired) { delete snapshot; }
+        retired.clear();
+      }
+    }
+
+    static auto merge(Snapshot const & snapshot) -> std::shared_ptr<std::vector<Range> const>
+    {
+      std::map<CUdeviceptr, Range> live;
+      for (auto const & range : *snapshot.ranges) { live.emplace(range.begin, range); }
+      for (auto const & range : snapshot.log) {
+        if (range.removed) { live.erase(range.begin); } else { live[range.begin] = range; }
+      }
+      auto ranges = std::make_shared<std::vector<Range>>();
+      ranges->reserve(live.size());
+      for (auto & kv : live) { ranges->push_back(std::move(kv.second)); }
+      return ranges;
+    }
+
+    std::atomic<bool> on{false};
+    std::atomic<Snapshot const *> current{nullptr};
+    mutable std::atomic<long> readers{0};
+    std::mutex mutex;
+    std::vector<Snapshot const *> retired;
+  } g_owners;
+
+  // An allocation must have one owner, so it may be captured by one
+  // Deviceptr backend at a time. Capturing an allocation takes the returned
+  // lock, which throws if the other backend has it, and holds it until the
+  // capture is registered. Defined after both backends.
+  template<typename Box>
+  auto claim_deviceptr(uintptr_t i_res) -> std::unique_lock<std::mutex>;
+
+  struct Deviceptr
+  {
+    CUdeviceptr res = 0;
+    MemPoolH h_pool;
+    StreamH h_stream;
+    int device = 0;
+    size_t size = 0; // if known
+    bool indexed = false;
+    static Cache<Deviceptr> cache;
+    static constexpr char const * class_name = "Deviceptr";
+    static constexpr char const * cuda_resource_name = "CUdeviceptr";
+
+    Deviceptr() = default;
+    Deviceptr(
+        CUdeviceptr res
+      , MemPoolH const & h_pool = MemPoolH{}
+      , StreamH const & h_stream = StreamH{}
+      )
+      : res{res}, h_pool{h_pool}, h_stream{h_stream}, device{pool_device(h_pool)}
+    {}
+
+    static int pool_device(MemPoolH const & h_pool) { return h_pool ? h_pool->device : 0; }
+
+    uintptr_t as_int() const { return to_uintptr(res); }
+
+    // Captures an allocation, of size bytes if known (non-zero).
+    static auto capture(
+        uintptr_t i_res, MemPoolH const & h_pool, StreamH const & h_stream, size_t size = 0
+      ) -> DeviceptrH
+    {
+      std::unique_lock<std::mutex> claim;
+      return cache.find_or_insert(i_res, [&]{ return pool_device(h_pool); }, [&](int device)
+        {
+          claim = claim_deviceptr<Deviceptr>(i_res);
+          USAGE(on(device).devptrs += 1);
+          MESSAGE("Capturing Deviceptr 0x" << std::hex << i_res);
+          auto res = static_cast<CUdeviceptr>(i_res);
+          auto * box = new Deviceptr(res, h_pool, h_stream);
+          box->size = size;
+          box->indexed = size && g_owners.enabled();
+          auto h_devp = DeviceptrH(box, [](auto * box)
+            {
+              auto _ = on_scope_exit([=]{ delete box; });
+              cache.erase_expired(box->as_int(), box->device);
+              if (box->indexed) { g_owners.erase(box->res, box->size); }
+              release(*box);
+            });
+          if (box->indexed) { g_owners.insert(h_devp, res, size); }
+          return h_devp;
+        });
+    }
+
+    // Allocates from a pool on a stream, reclaiming memory and retrying if
+    // the pool is out of memory.
+    static auto allocate(
+        size_t size, MemPoolH const & h_pool, StreamH const & h_stream
+      ) -> DeviceptrH
+    {
+      return capture(allocate_res(size, h_pool, h_stream), h_pool, h_stream, size);
+    }
+
+    static CUdeviceptr allocate_res(size_t size, MemPoolH const & h_pool, StreamH const & h_stream)
+    {
+      CUdeviceptr res = 0;
+      CUDA_CHECK(g_reclaim.allocate([&]
+        {
+          return driver().cuMemAllocFromPoolAsync(&res, size, h_pool->res, h_stream->res);
+        }, *h_pool, *h_stream));
+      return res;
+    }
+
+    // Frees the allocation on its stream, unless the stream is being
+    // captured. See "Graph Capture" below.
+    static void release(Deviceptr & box);
+
+    static void free(Deviceptr const & box)
+    {
+      USAGE(on(box.device).devptrs -= 1);
+      MESSAGE("Releasing Deviceptr 0x" << std::hex << box.as_int());
+      CUDA_CHECK(driver().cuMemFreeAsync(box.res, box.h_stream->res));
+    }
+
+    static auto capture_static(uintptr_t i_res) -> DeviceptrH
+    {
+      MESSAGE("Wrapping static Deviceptr 0x" << std::hex << i_res);
+      auto res = static_cast<CUdeviceptr>(i_res);
+      return DeviceptrH(new Deviceptr(res));
+    }
+  };
+
+  Cache<Deviceptr> Deviceptr::cache;
+
+  // Deviceptr box for the slot-table backend. See "Slot Holders" above.
+  struct SlotDeviceptr : Deviceptr
+  {
+    static SlotTable<SlotDeviceptr> table;
+    static Cache<SlotDeviceptr, SlotDeviceptrH::Weak> cache;
+
+    using Deviceptr::Deviceptr;
+
+    // Captures an allocation, of size bytes if known (non-zero). Slot
+    // allocations are not indexed for find_owner.
+    static auto capture(
+        uintptr_t i_res, MemPoolH const & h_pool, StreamH const & h_stream, size_t size = 0
+      ) -> SlotDeviceptrH
+    {
+      std::unique_lock<std::mutex> claim;
+      return cache.find_or_insert(i_res, [&]{ return pool_device(h_pool); }, [&](int device)
+        {
+          claim = claim_deviceptr<SlotDeviceptr>(i_res);
+          USAGE(on(device).devptrs += 1);
+          MESSAGE("Capturing slot Deviceptr 0x" << std::hex << i_res);
+          auto box = SlotDeviceptr(static_cast<CUdeviceptr>(i_res), h_pool, h_stream);
+          box.size = size;
+          return table.make(std::move(box), [](auto & box)
+            {
+              cache.erase_expired(box.as_int(), box.device);
+              Deviceptr::release(box);
+            });
+        });
+    }
+
+    static auto allocate(
+        size_t size, MemPoolH const & h_pool, StreamH const & h_stream
+      ) -> SlotDeviceptrH
+    {
+      return capture(allocate_res(size, h_pool, h_stream), h_pool, h_stream, size);
+    }
+
+    static auto capture_static(uintptr_t i_res) -> SlotDeviceptrH
+    {
+      MESSAGE("Wrapping static slot Deviceptr 0x" << std::hex << i_res);
+      auto res = static_cast<CUdeviceptr>(i_res);
+      return table.make(SlotDeviceptr(res));
+    }
+  };
+
+  SlotTable<SlotDeviceptr> SlotDeviceptr::table;
+  Cache<SlotDeviceptr, SlotDeviceptrH::Weak> SlotDeviceptr::cache;
+
+  std::mutex g_deviceptr_claims;
+
+  template<typename Box>
+  auto claim_deviceptr(uintptr_t i_res) -> std::unique_lock<std::mutex>
+  {
+    std::unique_lock<std::mutex> lock(g_deviceptr_claims);
+    bool const slot = std::is_same_v<Box, SlotDeviceptr>;
+    if (slot ? Deviceptr::cache.contains(i_res) : SlotDeviceptr::cache.contains(i_res)) {
+      std::ostringstream oss;
+      oss << "Deviceptr 0x" << std::hex << i_res << " is already captured by "
+          << (slot ? "Deviceptr" : "slots.Deviceptr");
+      throw std::invalid_argument(oss.str());
+    }
+    return lock;
+  }
+
+  // Deviceptr Slices
+  // ================
+  //
+  // A view of size bytes of an allocation, from an offset. A slice holds
+  // the allocation, so that it outlives the slice, and frees nothing itself.
+  // Slices of a slice hold the same allocation, which is either a Deviceptr
+  // or a slot Deviceptr. Slices live in a slot table
+  // (see "Slot Holders" above), so making one allocates no memory once the
+  // table has grown, and touches no reference count but the allocation's.
+  struct DeviceptrSlice
+  {
+    CUdeviceptr res = 0;
+    size_t size = 0;
+    DeviceptrH h_parent;          // either this
+    SlotDeviceptrH h_slot_parent; // or this
+    int device = 0;
+    static SlotTable<DeviceptrSlice> table;
+    static constexpr char const * class_name = "DeviceptrSlice";
+    static constexpr char const * cuda_resource_name = "CUdeviceptr";
+
+    uintptr_t as_int() const { return to_uintptr(res); }
+
+    Deviceptr const * parent() const
+    {
+      if (h_parent) { return h_parent.get(); }
+      if (h_slot_parent) { return h_slot_parent.get(); }
+      return nullptr;
+    }
+
+    template<typename Holder>
+    static auto make(Holder const & h_parent, size_t offset, size_t size) -> DeviceptrSliceH
+    {
+      if (!h_parent) { throw std::invalid_argument("Cannot slice a null Deviceptr"); }
+      if (h_parent->size && (offset > h_parent->size || size > h_parent->size - offset)) {
+        throw std::out_of_range("Slice exceeds its Deviceptr");
+      }
+      DeviceptrSlice slice;
+      slice.res = h_parent->res + offset;
+      slice.size = size;
+      slice.device = h_parent->device;
+      if constexpr (std::is_same_v<Holder, SlotDeviceptrH>) {
+        slice.h_slot_parent = h_parent;
+      } else {
+        slice.h_parent = h_parent;
+      }
+      return table.make(std::move(slice), [](auto & box)
+        {
+          // Drop the allocation before the table is locked to free the slot.
+          box.h_parent.reset();
+          box.h_slot_parent = {};
+        });
+    }
+
+    static auto make(DeviceptrSlice const & slice, size_t offset, size_t size) -> DeviceptrSliceH
+    {
+      auto const * parent = slice.parent();
+      if (!parent) { throw std::invalid_argument("Cannot slice a reset slice"); }
+      if (offset > slice.size || size > slice.size - offset) {
+        throw std::out_of_range("Slice exceeds its parent slice");
+      }
+      offset += slice.res - parent->res;
+      return slice.h_parent
+        ? make(slice.h_parent, offset, size)
+        : make(slice.h_slot_parent, offset, size);
+    }
+  };
+
+  SlotTable<DeviceptrSlice> DeviceptrSlice::table;
+
+  // Graph Capture
+  // =============
+  //
+  // Freeing an allocation on a stream that is being captured would add the
+  // free to the graph, or fail. Allocations released during capture are
+  // deferred instead, with their owners, by stream. Once capture on a stream
+  // has ended, its deferred allocations are freed only when memory runs out
+  // or `flush_capture_deferred` is called.
+  //
+  // A graph captured on the stream may still use those allocations. A
+  // GraphExec captured with the stream adopts its deferred allocations, and
+  // frees them only when it is released. Capture the GraphExec right after
+  // instantiating it, before the allocating thread can run out of memory.
+  class CaptureDeferrals
+  {
+  public:
+    // Defers freeing box if its stream is being captured. Returns whether
+    // it did.
+    bool defer(Deviceptr const & box)
+    {
+      auto status = CU_STREAM_CAPTURE_STATUS_NONE;
+      CUDA_CHECK(driver().cuStreamIsCapturing(box.h_stream->res, &status));
+      if (status == CU_STREAM_CAPTURE_STATUS_NONE) { return false; }
+      MESSAGE("Deferring free of Deviceptr 0x" << std::hex << box.as_int() << " until capture ends");
+      std::lock_guard<std::mutex> lock(mutex);
+      pending[box.h_stream->res].push_back(box);
+      npending += 1;
+      return true;
+    }
+
+    // Frees the deferred allocations of streams no longer being captured.
+    // Returns the number freed.
+    size_t flush()
+    {
+      if (npending.load(std::memory_order_relaxed) == 0) { return 0; }
+      std::vector<Deviceptr> ready;
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (auto it = pending.begin(); it != pending.end();) {
+          auto status = CU_STREAM_CAPTURE_STATUS_NONE;
+          CUDA_CHECK(driver().cuStreamIsCapturing(it->first, &status));
+          if (status != CU_STREAM_CAPTURE_STATUS_NONE) { ++it; continue; }
+          std::move(it->second.begin(), it->second.end(), std::back_inserter(ready));
+          it = pending.erase(it);
+        }
+        npending -= ready.size();
+      }
+      for (auto const & box : ready) { Deviceptr::free(box); }
+      return ready.size();
+    }
+
+    // Removes and returns the deferred allocations of stream.
+    auto adopt(CUstream stream) -> std::vector<Deviceptr>
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      auto it = pending.find(stream);
+      if (it == pending.end()) { return {}; }
+      auto adopted = std::move(it->second);
+      pending.erase(it);
+      npending -= adopted.size();
+      return adopted;
+    }
+
+  private:
+    std::mutex mutex;
+    std::unordered_map<CUstream, std::vector<Deviceptr>> pending;
+    std::atomic<size_t> npending{0};
+  } g_capture_frees;
+
+  void Deviceptr::release(Deviceptr & box)
+  {
+    if (!g_capture_frees.defer(box)) { free(box); }
+  }
+
+  struct GraphExec
+  {
+    CUgraphExec res = nullptr;
+    int device = 0;
+    std::shared_ptr<std::vector<Deviceptr>> adopted;
+    static Cache<GraphExec> cache;
+    static constexpr char const * class_name = "GraphExec";
+    static constexpr char const * cuda_resource_name = "CUgraphExec";
+
+    GraphExec() = default;
+    GraphExec(CUgraphExec res, int device, std::vector<Deviceptr> adopted)
+      : res{res}, device{device}
+      , adopted{std::make_shared<std::vector<Deviceptr>>(std::move(adopted))}
+    {}
+
+    uintptr_t as_int() const { return to_uintptr(res); }
+
+    // Captures an instantiated graph, adopting the allocations whose frees
+    // were deferred while h_stream was captured, if given.
+    static auto capture(uintptr_t i_res, StreamH const & h_stream) -> GraphExecH
+    {
+      return cache.find_or_insert(i_res, [&]{ return current_device(); }, [&](int device)
+        {
+          MESSAGE("Capturing GraphExec 0x" << std::hex << i_res);
+          auto res = reinterpret_cast<CUgraphExec>(i_res);
+          auto adopted = h_stream ? g_capture_frees.adopt(h_stream->res) : std::vector<Deviceptr>{};
+          return GraphExecH(new GraphExec(res, device, std::move(adopted)), [](auto * box)
+            {
+              MESSAGE("Releasing GraphExec 0x" << std::hex << box->as_int());
+              auto _ = on_scope_exit([=]{ delete box; });
+              cache.erase_expired(box->as_int(), box->device);
+              CUDA_CHECK(driver().cuGraphExecDestroy(box->res));
+              for (auto const & devp : *box->adopted) { Deviceptr::free(devp); }
+            });
+        });
+    }
+  };
+
+  Cache<GraphExec> GraphExec::cache;
+
+  // Spillable Deviceptr
+  // ===================
+  //
+  // A device allocation whose contents can be evicted ("spilled") to pinned
+  // host memory, and are brought back when its value is next read. Each
+  // memory pool has a budget of bytes its spillable buffers may keep
+  // resident. Allocating or bringing back a buffer over budget first spills
+  // the least recently used buffers of that pool. Buffers are also spilled
+  // by the reclaim chain when their pool runs out of memory.
+  //
+  // Spilling and bringing back are ordered on the buffer's stream, so work
+  // using the buffer must be ordered on that stream too. Neither waits for
+  // its copy: the copy to host records an event, which the copy back waits
+  // for on the stream, and the host copy is freed by the completion thread
+  // once the copy back completes. A spilled buffer keeps its owners, so its
+  // pool and stream outlive it.
+  struct SpillableDeviceptr
+  {
+    // Residency of the spillable buffers of one pool.
+    struct Budget
+    {
+      std::recursive_mutex mutex;
+      std::weak_ptr<MemPool> pool;
+      size_t limit = SIZE_MAX;
+      size_t resident = 0;
+      std::list<SpillableDeviceptr const *> lru; // least recently used first
+    };
+
+    // Where the contents of one buffer are, guarded by its budget's mutex.
+    struct State
+    {
+      CUdeviceptr res = 0;
+      void * host = nullptr;
+      CUcontext ctx = nullptr;
+      CUevent copied = nullptr; // recorded after the copy to host, in ctx
+      size_t size = 0;
+      std::shared_ptr<Budget> budget;
+      std::list<SpillableDeviceptr const *>::iterator lru;
+    };
+
+    State * state = nullptr;
+    MemPoolH h_pool;
+    StreamH h_stream;
+    int device = 0;
+    static constexpr char const * class_name = "SpillableDeviceptr";
+    static constexpr char const * cuda_resource_name = "CUdeviceptr";
+
+    SpillableDeviceptr() = default;
+    SpillableDeviceptr(
+        State * state, MemPoolH const & h_pool, StreamH const & h_stream
+      )
+      : state{state}, h_pool{h_pool}, h_stream{h_stream}, device{h_pool->device}
+    {}
+
+    // Brings the contents back to the device, if spilled, and marks the
+    // buffer most recently used.
+    uintptr_t as_int() const
+    {
+      if (!state) { return 0; }
+      return to_uintptr(make_resident(*this));
+    }
+
+    bool spilled() const
+    {
+      if (!state) { return false; }
+      std::lock_guard<std::recursive_mutex> lock(state->budget->mutex);
+      return state->res == 0;
+    }
+
+    size_t size() const { return state ? state->size : 0; }
+
+    static auto allocate(
+        size_t size, MemPoolH const & h_pool, StreamH const & h_stream
+      ) -> SpillableDeviceptrH
+    {
+      USAGE(on(h_pool->device).devptrs += 1);
+      auto state = new State{};
+      state->size = size;
+      state->budget = budget_for(h_pool);
+      auto h = SpillableDeviceptrH(
+          new SpillableDeviceptr(state, h_pool, h_stream), [](auto * box)
+            {
+              auto _ = on_scope_exit([=]{ delete box->state; delete box; });
+              release(*box);
+            }
+        );
+      auto const res = make_resident(*h);
+      MESSAGE("Allocated spillable Deviceptr 0x" << std::hex << res);
+      return h;
+    }
+
+    static void release(SpillableDeviceptr & box)
+    {
+      USAGE(on(box.device).devptrs -= 1);
+      auto & st = *box.state;
+      std::lock_guard<std::recursive_mutex> lock(st.budget->mutex);
+      if (st.res) {
+        MESSAGE("Releasing spillable Deviceptr 0x" << std::hex << st.res);
+        st.budget->resident -= st.size;
+        st.budget->lru.erase(st.lru);
+        CUDA_CHECK(driver().cuMemFreeAsync(st.res, box.h_stream->res));
+      }
+      if (st.host) {
+        MESSAGE("Releasing spilled Deviceptr host copy " << st.host);
+        auto const stream = box.h_stream->res;
+        if (st.copied) { CUDA_CHECK(driver().cuStreamWaitEvent(stream, st.copied, 0)); }
+        free_host_after(st, stream);
+      }
+    }
+
+    // Spills the buffer to host memory. Call with the budget locked.
+    static void spill(SpillableDeviceptr const & box)
+    {
+      auto & st = *box.state;
+      if (!st.res) { return; }
+      MESSAGE("Spilling Deviceptr 0x" << std::hex << st.res);
+      auto const stream = box.h_stream->res;
+      CUDA_CHECK(driver().cuMemAllocHost(&st.host, st.size));
+      CUDA_CHECK(driver().cuMemcpyDtoHAsync(st.host, st.res, st.size, stream));
+      CUDA_CHECK(driver().cuMemFreeAsync(st.res, stream));
+      record_copied(st, stream);
+      st.res = 0;
+      st.budget->resident -= st.size;
+      st.budget->lru.erase(st.lru);
+    }
+
+    // Spills least recently used buffers until size more bytes fit in the
+    // budget, or none are left. Call with the budget locked.
+    static void admit(Budget & budget, size_t size)
+    {
+      while (budget.resident + size > budget.limit && !budget.lru.empty()) {
+        spill(*budget.lru.front());
+      }
+    }
+
+    // Brings the buffer back, if spilled, marks it most recently used, and
+    // returns its device address. Call with the budget unlocked: allocating
+    // may run the reclaim chain, which waits for the completion thread, and
+    // that thread may be releasing another buffer of the budget. The budget
+    // may therefore be exceeded while buffers are brought back concurrently.
+    static CUdeviceptr make_resident(SpillableDeviceptr const & box)
+    {
+      auto & st = *box.state;
+      auto & budget = *st.budget;
+      {
+        std::lock_guard<std::recursive_mutex> lock(budget.mutex);
+        if (st.res) {
+          budget.lru.splice(budget.lru.end(), budget.lru, st.lru);
+          return st.res;
+        }
+        admit(budget, st.size);
+      }
+      CUdeviceptr res = 0;
+      auto const stream = box.h_stream->res;
+      CUDA_CHECK(g_reclaim.allocate([&]
+        {
+          return driver().cuMemAllocFromPoolAsync(&res, st.size, box.h_pool->res, stream);
+        }, *box.h_pool, *box.h_stream));
+
+      std::lock_guard<std::recursive_mutex> lock(budget.mutex);
+      if (st.res) {
+        // Brought back by another thread meanwhile.
+        CUDA_CHECK(driver().cuMemFreeAsync(res, stream));
+        budget.lru.splice(budget.lru.end(), budget.lru, st.lru);
+        return st.res;
+      }
+      st.res = res;
+      if (st.host) {
+        MESSAGE("Restoring spilled Deviceptr 0x" << std::hex << st.res);
+        CUDA_CHECK(driver().cuStreamWaitEvent(stream, st.copied, 0));
+        CUDA_CHECK(driver().cuMemcpyHtoDAsync(st.res, st.host, st.size, stream));
+        free_host_after(st, stream);
+      }
+      budget.resident += st.size;
+      st.lru = budget.lru.insert(budget.lru.end(), &box);
+      return st.res;
+    }
+
+    static auto find_budget(MemPool const * pool) -> std::shared_ptr<Budget>
+    {
+      std::lock_guard<std::mutex> lock(budgets_mutex);
+      auto it = budgets.find(pool);
+      return it != budgets.end() ? it->second : nullptr;
+    }
+
+    static auto budget_for(MemPoolH const & h_pool) -> std::shared_ptr<Budget>
+    {
+      std::lock_guard<std::mutex> lock(budgets_mutex);
+      auto & budget = budgets[h_pool.get()];
+      if (!budget || budget->pool.lock() != h_pool) {
+        budget = std::make_shared<Budget>();
+        budget->pool = h_pool;
+      }
+      return budget;
+    }
+
+    // Defined after the completion queue.
+    static void record_copied(State & st, CUstream stream);
+    static void free_host_after(State & st, CUstream stream);
+
+    static void set_budget(MemPoolH const & h_pool, size_t limit)
+    {
+      auto budget = budget_for(h_pool);
+      std::lock_guard<std::recursive_mutex> lock(budget->mutex);
+      budget->limit = limit;
+      admit(*budget, 0);
+    }
+
+    static size_t resident_bytes(MemPoolH const & h_pool)
+    {
+      auto budget = budget_for(h_pool);
+      std::lock_guard<std::recursive_mutex> lock(budget->mutex);
+      return budget->resident;
+    }
+
+    static std::mutex budgets_mutex;
+    static std::unordered_map<MemPool const *, std::shared_ptr<Budget>> budgets;
+  };
+
+  std::mutex SpillableDeviceptr::budgets_mutex;
+  std::unordered_map<MemPool const *, std::shared_ptr<SpillableDeviceptr::Budget>>
+    SpillableDeviceptr::budgets;
+
+  void ReclaimChain::spill(MemPool const & pool, Stream const &)
+  {
+    auto const budget = SpillableDeviceptr::find_budget(&pool);
+    if (!budget) { return; }
+    std::lock_guard<std::recursive_mutex> lock(budget->mutex);
+    while (!budget->lru.empty()) {
+      SpillableDeviceptr::spill(*budget->lru.front());
+    }
+  }
+
+  // Managed Memory
+  // ==============
+  //
+  // A ManagedPtr boxes an allocation from cuMemAllocManaged, whose pages
+  // migrate between the host and devices on demand. Prefetches and advice
+  // are issued in batches, for many ranges in one call. A prefetch already
+  // covered by an earlier one in the same batch is skipped. Pages migrate
+  // back on access, so a prefetch issued by an earlier batch says nothing
+  // about where they are now, and is issued again. Advice persists until it
+  // is changed, so each allocation remembers the advice issued for its
+  // ranges, and advice that matches what was last issued for the whole range
+  // is skipped.
+
+  // Values assigned to byte ranges, kept as disjoint intervals.
+  template<typename Value>
+  class RangeMap
+  {
+  public:
+    // Returns whether all of [begin, end) was last assigned value.
+    bool covers(size_t begin, size_t end, Value const & value) const
+    {
+      auto it = ranges.upper_bound(begin);
+      if (it == ranges.begin()) { return false; }
+      --it;
+      while (begin < end) {
+        if (it == ranges.end() || it->first > begin) { return false; }
+        auto const & [until, v] = it->second;
+        if (until <= begin || !(v == value)) { return false; }
+        begin = until;
+        ++it;
+      }
+      return true;
+    }
+
+    void assign(size_t begin, size_t end, Value const & value)
+    {
+      auto it = ranges.lower_bound(begin);
+      if (it != ranges.begin()) {
+        auto & [until, v] = std::prev(it)->second;
+        if (until > end) { ranges.emplace(end, std::make_pair(until, v)); }
+        if (until > begin) { until = begin; }
+      }
+      while (it != ranges.end() && it->first < end) {
+        if (it->second.first > end) { ranges.emplace(end, it->second); }
+        it = ranges.erase(it);
+      }
+      ranges[begin] = {end, value};
+    }
+
+  private:
+    std::map<size_t, std::pair<size_t, Value>> ranges; // begin -> (end, value)
+  };
+
+  struct ManagedPtr
+  {
+    // Advice issued so far, guarded by mutex, by kind and, for accessed-by
+    // advice, device.
+    struct Hints
+    {
+      std::mutex mutex;
+      std::map<std::pair<int, int>, RangeMap<int>> advised;
+    };
+
+    struct Prefetch
+    {
+      ManagedPtrH h_ptr;
+      size_t offset;
+      size_t size;
+      int device; // CU_DEVICE_CPU for the host
+    };
+
+    struct Advice
+    {
+      ManagedPtrH h_ptr;
+      size_t offset;
+      size_t size;
+      CUmem_advise advice;
+      int device;
+    };
+
+    CUdeviceptr res = 0;
+    size_t size = 0;
+    int device = 0;
+    std::shared_ptr<Hints> hints;
+    static constexpr char const * class_name = "ManagedPtr";
+    static constexpr char const * cuda_resource_name = "CUdeviceptr";
+
+    ManagedPtr() = default;
+    ManagedPtr(CUdeviceptr res, size_t size, int device)
+      : res{res}, size{size}, device{device}, hints{std::make_shared<Hints>()}
+    {}
+
+    uintptr_t as_int() const { return to_uintptr(res); }
+
+    static auto allocate(size_t size) -> ManagedPtrH
+    {
+      CUdeviceptr res = 0;
+      CUDA_CHECK(driver().cuMemAllocManaged(&res, size, CU_MEM_ATTACH_GLOBAL));
+      auto const device = current_device();
+      USAGE(on(device).devptrs += 1);
+      MESSAGE("Allocated ManagedPtr 0x" << std::hex << res);
+      return ManagedPtrH(new ManagedPtr(res, size, device), [](auto * box)
+        {
+          USAGE(on(box->device).devptrs -= 1);
+          MESSAGE("Releasing ManagedPtr 0x" << std::hex << box->as_int());
+          auto _ = on_scope_exit([=]{ delete box; });
+          CUDA_CHECK(driver().cuMemFree(box->res));
+        });
+    }
+
+    // Prefetches each range to its device, on stream. Returns the number of
+    // prefetches issued. Ranges are checked before any is issued.
+    static size_t prefetch(std::vector<Prefetch> const & batch, Stream const & stream)
+    {
+      for (auto const & p : batch) { check(p.h_ptr, p.offset, p.size); }
+      std::map<ManagedPtr const *, RangeMap<int>> batched;
+      size_t issued = 0;
+      for (auto const & p : batch) {
+        auto & box = *p.h_ptr;
+        auto & prefetched = batched[&box];
+        if (prefetched.covers(p.offset, p.offset + p.size, p.device)) { continue; }
+        CUDA_CHECK(driver().cuMemPrefetchAsync(box.res + p.offset, p.size, p.device, stream.res));
+        prefetched.assign(p.offset, p.offset + p.size, p.device);
+        issued += 1;
+      }
+      return issued;
+    }
+
+    // Applies each advice to its range. Returns the number of calls issued.
+    // Ranges and advice are checked before any is issued.
+    static size_t advise(std::vector<Advice> const & batch)
+    {
+      for (auto const & a : batch) {
+        check(a.h_ptr, a.offset, a.size);
+        advice_state(a.advice, a.device);
+      }
+      size_t issued = 0;
+      for (auto const & a : batch) {
+        auto & box = *a.h_ptr;
+        auto const [kind, value] = advice_state(a.advice, a.device);
+        std::lock_guard<std::mutex> lock(box.hints->mutex);
+        auto & advised = box.hints->advised[kind];
+        if (advised.covers(a.offset, a.offset + a.size, value)) { continue; }
+        CUDA_CHECK(driver().cuMemAdvise(box.res + a.offset, a.size, a.advice, a.device));
+        advised.assign(a.offset, a.offset + a.size, value);
+        issued += 1;
+      }
+      return issued;
+    }
+
+  private:
+    static void check(ManagedPtrH const & h_ptr, size_t offset, size_t size)
+    {
+      if (!h_ptr || !h_ptr->hints || offset > h_ptr->size || size > h_ptr->size - offset) {
+        throw std::out_of_range("Range is outside the managed allocation");
+      }
+    }
+
+    // The kind of state an advice sets, and the value it sets it to.
+    static auto advice_state(CUmem_advise advice, int device)
+      -> std::pair<std::pair<int, int>, int>
+    {
+      constexpr int unset = INT_MIN;
+      switch (advice) {
+        case CU_MEM_ADVISE_SET_READ_MOSTLY: return {{0, 0}, 1};
+        case CU_MEM_ADVISE_UNSET_READ_MOSTLY: return {{0, 0}, 0};
+        case CU_MEM_ADVISE_SET_PREFERRED_LOCATION: return {{1, 0}, device};
+        case CU_MEM_ADVISE_UNSET_PREFERRED_LOCATION: return {{1, 0}, unset};
+        case CU_MEM_ADVISE_SET_ACCESSED_BY: return {{2, device}, 1};
+        case CU_MEM_ADVISE_UNSET_ACCESSED_BY: return {{2, device}, 0};
+        default: throw std::invalid_argument("Unknown advice " + std::to_string(advice));
+      }
+    }
+  };
+
+  // Every capture now goes through the registry, so this is the same as
+  // Box::capture. Kept for existing callers.
+  template<typename Box, typename ... Args>
+  auto capture_cached(uintptr_t i_res, Args && ... args)
+  {
+    return Box::capture(i_res, std::forward<Args>(args)...);
+  }
+
+  // File Loader
+  // ===========
+  //
+  // Streams a region of a file into device memory. Chunks are read with
+  // pread into a ring of pinned staging buffers, and each chunk is copied to
+  // the device asynchronously on the stream. A staging buffer is refilled
+  // only once the event recorded after its previous copy has completed, so
+  // reading a chunk overlaps with transferring the chunks before it. Returns
+  // after the last chunk has landed, so the destination and stream holders
+  // are kept alive throughout.
+
+  [[noreturn]] void raise_os_error(std::string const & what)
+  {
+    throw std::system_error(errno, std::generic_category(), what);
+  }
+
+  // Reads exactly size bytes at offset, retrying on short reads.
+  void pread_fully(int fd, void * buf, size_t size, off_t offset, std::string const & path)
+  {
+    auto * p = static_cast<char *>(buf);
+    while (size > 0) {
+      auto const n = ::pread(fd, p, size, offset);
+      if (n < 0) {
+        if (errno == EINTR) { continue; }
+        raise_os_error("Reading " + path);
+      }
+      if (n == 0) { throw std::runtime_error("Unexpected end of file " + path); }
+      p += n;
+      offset += n;
+      size -= static_cast<size_t>(n);
+    }
+  }
+
+  // Loads length bytes (or the rest of the file, if zero) from file_offset
+  // into the device allocation at dst_offset. Returns the bytes loaded. If
+  // the allocation's size is known, the region must fit in it.
+  size_t load_file(
+      std::string const & path
+    , DeviceptrH const & h_dst
+    , StreamH const & h_stream
+    , size_t dst_offset
+    , size_t file_offset
+    , size_t length
+    , size_t chunk_size
+    , int nbuffers
+    )
+  {
+    if (chunk_size == 0 || nbuffers < 1) {
+      throw std::invalid_argument("chunk_size and nbuffers must be positive");
+    }
+
+    int const fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) { raise_os_error("Opening " + path); }
+    auto _fd = on_scope_exit([=]{ ::close(fd); });
+
+    if (length == 0) {
+      struct stat st;
+      if (::fstat(fd, &st) != 0) { raise_os_error("Inspecting " + path); }
+      auto const file_size = static_cast<size_t>(st.st_size);
+      length = file_size > file_offset ? file_size - file_offset : 0;
+    }
+    if (length == 0) { return 0; }
+    if (h_dst->size && (dst_offset > h_dst->size || length > h_dst->size - dst_offset)) {
+      throw std::out_of_range("Loading " + std::to_string(length) + " bytes at offset "
+        + std::to_string(dst_offset) + " overruns the " + std::to_string(h_dst->size)
+        + " byte allocation");
+    }
+    chunk_size = std::min(chunk_size, length);
+
+    struct Staging
+    {
+      void * host = nullptr;
+      CUevent event = nullptr;
+    };
+
+    // On the way out, wait for outstanding copies before freeing buffers.
+    std::vector<Staging> ring(nbuffers);
+    auto _ring = on_scope_exit([&]
+      {
+        for (auto & s : ring) {
+          if (s.event) {
+            driver().cuEventSynchronize(s.event);
+            driver().cuEventDestroy(s.event);
+          }
+          if (s.host) { driver().cuMemFreeHost(s.host); }
+        }
+      });
+    for (auto & s : ring) {
+      CUDA_CHECK(driver().cuMemHostAlloc(&s.host, chunk_size, 0));
+      CUDA_CHECK(driver().cuEventCreate(&s.event, CU_EVENT_DISABLE_TIMING));
+    }
+
+    MESSAGE("Loading " << length << " bytes of " << path << " to Deviceptr 0x"
+            << std::hex << h_dst->as_int());
+    auto const stream = h_stream->res;
+    size_t loaded = 0;
+    for (size_t i = 0; loaded < length; ++i) {
+      auto & s = ring[i % ring.size()];
+      auto const n = std::min(chunk_size, length - loaded);
+      CUDA_CHECK(driver().cuEventSynchronize(s.event));
+      pread_fully(fd, s.host, n, static_cast<off_t>(file_offset + loaded), path);
+      CUDA_CHECK(driver().cuMemcpyHtoDAsync(h_dst->res + dst_offset + loaded, s.host, n, stream));
+      CUDA_CHECK(driver().cuEventRecord(s.event, stream));
+      loaded += n;
+    }
+    return loaded;
+  }
+
+  // Completion Queue
+  // ================
+  //
+  // Runs actions, and drops Python objects, once the work queued so far on a
+  // stream completes, without synchronizing the caller. Each request records
+  // a pooled event on the stream. A single background thread polls the
+  // oldest pending event of each stream (events on a stream complete in
+  // order), runs the actions of completed requests in the context they were
+  // made in, and then drops their Python objects in one batch under the GIL.
+
+  // Reusable events, by context and creation flags.
+  class EventPool
+  {
+  public:
+    // Returns an event of the current context, ctx.
+    CUevent acquire(CUcontext ctx, unsigned int flags)
+    {
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto & free = pools[{ctx, flags}];
+        if (!free.empty()) {
+          auto event = free.back();
+          free.pop_back();
+          return event;
+        }
+      }
+      CUevent event = nullptr;
+      CUDA_CHECK(driver().cuEventCreate(&event, flags));
+      return event;
+    }
+
+    void release(CUcontext ctx, unsigned int flags, CUevent event)
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      pools[{ctx, flags}].push_back(event);
+    }
+
+  private:
+    std::mutex mutex;
+    std::map<std::pair<CUcontext, unsigned int>, std::vector<CUevent>> pools;
+  } g_events;
+
+  // Makes ctx current on this thread, if it is not already.
+  void set_context(CUcontext ctx)
+  {
+    thread_local CUcontext current = nullptr;
+    if (ctx != current) {
+      CUDA_CHECK(driver().cuCtxSetCurrent(ctx));
+      current = ctx;
+    }
+  }
+
+  class CompletionQueue
+  {
+  public:
+    // Runs action, then drops retained (with the GIL held), once the work
+    // queued so far on stream completes. The action runs on the completion
+    // thread, without the GIL. Errors it throws are reported and ignored.
+    void after(CUstream stream, std::function<void()> action, py::object retained = {})
+    {
+      CUcontext ctx = nullptr;
+      CUDA_CHECK(driver().cuCtxGetCurrent(&ctx));
+      auto const event = g_events.acquire(ctx, CU_EVENT_DISABLE_TIMING);
+      auto const result = driver().cuEventRecord(event, stream);
+      if (result != CUDA_SUCCESS) {
+        g_events.release(ctx, CU_EVENT_DISABLE_TIMING, event);
+        raise_cuda_error(result);
+      }
+
+      std::lock_guard<std::mutex> lock(mutex);
+      if (!worker.joinable() && !stopping) {
+        worker = std::thread([this] { this->run(); });
+      }
+      pending[stream].push_back({ctx, event, std::move(action), std::move(retained), {}, next_seq});
+      outstanding.insert(next_seq++);
+      npending += 1;
+      wakeup.notify_one();
+    }
+
+    // Runs action once the work recorded in h_event completes. The event is
+    // held until then, and each event is waited for on its own.
+    void after(EventH h_event, std::function<void()> action)
+    {
+      CUcontext ctx = nullptr;
+      CUDA_CHECK(driver().cuCtxGetCurrent(&ctx));
+      auto const key = reinterpret_cast<CUstream>(h_event->res);
+      auto const event = h_event->res;
+
+      std::lock_guard<std::mutex> lock(mutex);
+      if (!worker.joinable() && !stopping) {
+        worker = std::thread([this] { this->run(); });
+      }
+      pending[key].push_back({ctx, event, std::move(action), {}, std::move(h_event), next_seq});
+      outstanding.insert(next_seq++);
+      npending += 1;
+      wakeup.notify_one();
+    }
+
+    size_t size()
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      return npending;
+    }
+
+    // Waits until the completion thread has completed everything pending
+    // now. The GIL is released meanwhile, since the completion thread takes
+    // it to drop retained objects. Returns at once on the completion thread
+    // itself, or once it is stopped.
+    void flush()
+    {
+      std::optional<py::gil_scoped_release> nogil;
+      if (PyGILState_Check()) { nogil.emplace(); }
+      std::unique_lock<std::mutex> lock(mutex);
+      if (!worker.joinable() || std::this_thread::get_id() == worker.get_id()) { return; }
+      auto const last = next_seq;
+      drained.wait(lock, [&]
+        {
+          return stopping || outstanding.empty() || *outstanding.begin() >= last;
+        });
+    }
+
+    // Stops the completion thread, then waits for and completes everything
+    // still pending. Called with the GIL held, at interpreter exit.
+    void shutdown()
+    {
+      std::vector<Entry> rest;
+      {
+        py::gil_scoped_release nogil;
+        {
+          std::lock_guard<std::mutex> lock(mutex);
+          stopping = true;
+        }
+        wakeup.notify_all();
+        drained.notify_all();
+        if (worker.joinable()) { worker.join(); }
+        rest = take_all();
+        wait_and_run(rest);
+      }
+      rest.clear();
+    }
+
+    ~CompletionQueue()
+    {
+      // Without shutdown, Python is gone by now, so leak retained objects.
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+      }
+      wakeup.notify_all();
+      drained.notify_all();
+      if (worker.joinable()) { worker.join(); }
+      for (auto & kv : pending) {
+        for (auto & entry : kv.second) { entry.retained.release(); }
+      }
+    }
+
+  private:
+    struct Entry
+    {
+      CUcontext ctx;
+      CUevent event;
+      std::function<void()> action;
+      py::object retained;
+      EventH h_event; // if set, the event is not pooled
+      uint64_t seq = 0;
+    };
+
+    static constexpr auto poll_interval = std::chrono::microseconds(100);
+
+    static bool is_complete(Entry const & entry)
+    {
+      set_context(entry.ctx);
+      auto const result = driver().cuEventQuery(entry.event);
+      if (result == CUDA_ERROR_NOT_READY) { return false; }
+      if (result != CUDA_SUCCESS) {
+        MESSAGE("Completing after CUDA error " << static_cast<int>(result));
+      }
+      return true;
+    }
+
+    auto take_all() -> std::vector<Entry>
+    {
+      std::vector<Entry> entries;
+      std::lock_guard<std::mutex> lock(mutex);
+      for (auto & kv : pending) {
+        for (auto & entry : kv.second) { entries.push_back(std::move(entry)); }
+      }
+      pending.clear();
+      npending = 0;
+      return entries;
+    }
+
+    static void wait_and_run(std::vector<Entry> & entries)
+    {
+      for (auto & entry : entries) {
+        set_context(entry.ctx);
+        driver().cuEventSynchronize(entry.event);
+      }
+      run_actions(entries);
+    }
+
+    static bool has_retained(std::vector<Entry> const & entries)
+    {
+      return std::any_of(entries.begin(), entries.end(), [](auto const & e)
+        {
+          return bool(e.retained);
+        });
+    }
+
+    static void run_actions(std::vector<Entry> & entries)
+    {
+      for (auto & entry : entries) {
+        if (!entry.h_event) {
+          g_events.release(entry.ctx, CU_EVENT_DISABLE_TIMING, entry.event);
+        }
+        if (!entry.action) { continue; }
+        try {
+          set_context(entry.ctx);
+          entry.action();
+        } catch (std::exception const & e) {
+          std::cerr << "Error in completion action: " << e.what() << std::endl;
+        }
+      }
+    }
+
+    void run()
+    {
+      std::vector<Entry> done;
+      std::unique_lock<std::mutex> lock(mutex);
+      while (!stopping) {
+        if (npending == 0) {
+          wakeup.wait(lock);
+          continue;
+        }
+        for (auto it = pending.begin(); it != pending.end(); ) {
+          auto & queue = it->second;
+          while (!queue.empty() && is_complete(queue.front())) {
+            done.push_back(std::move(queue.front()));
+            queue.pop_front();
+            npending -= 1;
+          }
+          it = queue.empty() ? pending.erase(it) : std::next(it);
+        }
+        if (done.empty()) {
+          wakeup.wait_for(lock, poll_interval);
+          continue;
+        }
+
+        lock.unlock();
+        run_actions(done);
+        std::vector<uint64_t> seqs;
+        for (auto const & entry : done) { seqs.push_back(entry.seq); }
+        if (has_retained(done)) {
+          py::gil_scoped_acquire gil;
+          done.clear();
+        }
+        done.clear();
+        lock.lock();
+        for (auto seq : seqs) { outstanding.erase(seq); }
+        drained.notify_all();
+      }
+    }
+
+    std::mutex mutex;
+    std::condition_variable wakeup;
+    std::unordered_map<CUstream, std::deque<Entry>> pending;
+    size_t npending = 0;
+    uint64_t next_seq = 0;
+    std::set<uint64_t> outstanding; // of entries not yet completed
+    std::condition_variable drained;
+    bool stopping = false;
+    std::thread worker;
+  } g_completions;
+
+  // Records the copy to host queued on stream by a spill.
+  void SpillableDeviceptr::record_copied(State & st, CUstream stream)
+  {
+    CUDA_CHECK(driver().cuCtxGetCurrent(&st.ctx));
+    st.copied = g_events.acquire(st.ctx, CU_EVENT_DISABLE_TIMING);
+    auto const result = driver().cuEventRecord(st.copied, stream);
+    if (result != CUDA_SUCCESS) {
+      g_events.release(st.ctx, CU_EVENT_DISABLE_TIMING, st.copied);
+      st.copied = nullptr;
+      raise_cuda_error(result);
+    }
+  }
+
+  // Frees the host copy, and returns its event to the pool, once the work
+  // queued so far on stream completes.
+  void SpillableDeviceptr::free_host_after(State & st, CUstream stream)
+  {
+    g_completions.after(stream, [host = st.host, ctx = st.ctx, copied = st.copied]
+      {
+        if (copied) { g_events.release(ctx, CU_EVENT_DISABLE_TIMING, copied); }
+        CUDA_CHECK(driver().cuMemFreeHost(host));
+      });
+    st.host = nullptr;
+    st.copied = nullptr;
+  }
+
+  // Drops holders once the work queued so far on a stream completes, so that
+  // their allocations are freed no earlier, even when that stream is not
+  // their own. Holders of one call share a single completion request.
+  template<typename Holder>
+  void release_after(StreamH const & h_stream, std::vector<Holder> holders)
+  {
+    g_completions.after(h_stream->res, [holders = std::move(holders)]() mutable
+      {
+        holders.clear();
+      });
+  }
+
+  // Kernel Launches
+  // ===============
+  //
+  // Launches take holders as arguments, and hold them until the launch
+  // completes. Rather than one completion request per launch, holders are
+  // gathered per stream: while a batch is in flight, the holders of later
+  // launches wait for it, and go out together in the next batch, requested
+  // when it completes. So a steady stream of launches costs about one event
+  // per round trip of the completion thread.
+  //
+  // Later batches are requested from the completion thread, where the
+  // per-thread default stream is another stream, and the default streams
+  // are those of its own context. So launches on a default stream are not
+  // batched: each requests its own completion, from the launching thread.
+  class LaunchHolds
+  {
+  public:
+    struct Holds
+    {
+      std::vector<std::shared_ptr<void const>> shared;
+      std::vector<SlotDeviceptrH> slots;
+
+      bool empty() const { return shared.empty() && slots.empty(); }
+    };
+
+    void add(StreamH const & h_stream, Holds && holds)
+    {
+      if (is_default_stream(h_stream->res)) {
+        auto held = std::make_shared<Holds>(std::move(holds));
+        held->shared.push_back(h_stream);
+        g_completions.after(h_stream->res, [held]() mutable { held.reset(); });
+        return;
+      }
+
+      std::unique_lock<std::mutex> lock(mutex);
+      auto & batch = batches[h_stream->res];
+      move_append(batch.waiting.shared, holds.shared);
+      move_append(batch.waiting.slots, holds.slots);
+      batch.waiting.shared.push_back(h_stream);
+      if (!batch.in_flight) { submit(h_stream->res, lock); }
+    }
+
+    size_t waiting()
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      size_t n = 0;
+      for (auto const & kv : batches) {
+        n += kv.second.waiting.shared.size() + kv.second.waiting.slots.size();
+      }
+      return n;
+    }
+
+  private:
+    struct Batch
+    {
+      Holds waiting;
+      bool in_flight = false;
+    };
+
+    template<typename T>
+    static void move_append(std::vector<T> & to, std::vector<T> & from)
+    {
+      to.insert(to.end(), std::make_move_iterator(from.begin()), std::make_move_iterator(from.end()));
+    }
+
+    // Requests completion of the waiting holders, unlocking to do so.
+    void submit(CUstream stream, std::unique_lock<std::mutex> & lock)
+    {
+      auto & batch = batches[stream];
+      auto holds = std::make_shared<Holds>(std::move(batch.waiting));
+      batch.waiting = {};
+      batch.in_flight = true;
+      lock.unlock();
+      auto failed = on_scope_exit([&] {
+        lock.lock();
+        batches[stream].in_flight = false;
+      });
+      g_completions.after(stream, [this, stream, holds]() mutable
+        {
+          holds.reset();
+          completed(stream);
+        });
+      failed.release();
+      lock.lock();
+    }
+
+    void completed(CUstream stream)
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      auto it = batches.find(stream);
+      if (it->second.waiting.empty()) {
+        batches.erase(it);
+      } else {
+        submit(stream, lock);
+      }
+    }
+
+    std::mutex mutex;
+    std::unordered_map<CUstream, Batch> batches;
+  } g_launch_holds;
+
+  // Packed kernel arguments. Holders of device memory are passed as their
+  // pointer, and held; integers and bools as 64-bit words; and the bytes of
+  // buffers, such as numpy or ctypes scalars, verbatim, for parameters of
+  // any other type. The driver copies as many bytes as each parameter has,
+  // so floats, whose width is ambiguous, must come as such scalars.
+  struct LaunchArgs
+  {
+    std::vector<std::string> storage;
+    std::vector<void *> params;
+    LaunchHolds::Holds holds;
+
+    explicit LaunchArgs(py::args const & args)
+      : storage(args.size())
+    {
+      params.reserve(args.size());
+      size_t i = 0;
+      for (auto const & arg : args) {
+        auto & out = storage[i];
+        if (!(pack_holder<Deviceptr>(arg, out)
+              || pack_holder<ManagedPtr>(arg, out)
+              || pack_holder<SpillableDeviceptr>(arg, out)
+              || pack_holder<SlotDeviceptr, SlotDeviceptrH>(arg, out)
+              || pack_holder<DeviceptrSlice, DeviceptrSliceH>(arg, out)
+              || pack_value(arg, out))) {
+          throw std::invalid_argument(
+            "Cannot pass launch argument " + std::to_string(i) + ": "
+            + std::string(py::repr(arg)));
+        }
+        params.push_back(&out[0]);
+        i += 1;
+      }
+    }
+
+  private:
+    template<typename T>
+    static void pack_word(T value, std::string & out)
+    {
+      out.assign(reinterpret_cast<char const *>(&value), sizeof(value));
+    }
+
+    template<typename Box, typename Holder = std::shared_ptr<Box>>
+    bool pack_holder(py::handle arg, std::string & out)
+    {
+      if (!py::isinstance<Box>(arg)) { return false; }
+      auto h = arg.cast<Holder>();
+      uintptr_t value = 0;
+      if constexpr (std::is_same_v<Box, SpillableDeviceptr>) {
+        py::gil_scoped_release nogil; // may bring the buffer back
+        value = h->as_int();
+      } else {
+        value = h->as_int();
+      }
+      pack_word(static_cast<uint64_t>(value), out);
+      keep(std::move(h));
+      return true;
+    }
+
+    void keep(SlotDeviceptrH && h) { holds.slots.push_back(std::move(h)); }
+
+    void keep(DeviceptrSliceH && h)
+    {
+      if (h->h_parent) { holds.shared.push_back(h->h_parent); }
+      if (h->h_slot_parent) { holds.slots.push_back(h->h_slot_parent); }
+    }
+
+    template<typename Box>
+    void keep(std::shared_ptr<Box> && h) { holds.shared.push_back(std::move(h)); }
+
+    static bool pack_value(py::handle arg, std::string & out)
+    {
+      if (py::isinstance<py::int_>(arg)) {
+        // Modulo 2**64, so that signed and unsigned values both fit.
+        pack_word(static_cast<uint64_t>(PyLong_AsUnsignedLongLongMask(arg.ptr())), out);
+        return true;
+      }
+      if (py::isinstance<py::float_>(arg)) {
+        throw std::invalid_argument(
+          "Cannot pass float launch argument " + std::string(py::repr(arg))
+          + " without a width; pass e.g. numpy.float32 or ctypes.c_double");
+      }
+      if (PyObject_CheckBuffer(arg.ptr())) {
+        Py_buffer view{};
+        if (PyObject_GetBuffer(arg.ptr(), &view, PyBUF_C_CONTIGUOUS) != 0) {
+          throw py::error_already_set();
+        }
+        auto _ = on_scope_exit([&]{ PyBuffer_Release(&view); });
+        if (view.len == 0) { throw std::invalid_argument("Cannot pass an empty buffer launch argument"); }
+        out.assign(static_cast<char const *>(view.buf), static_cast<size_t>(view.len));
+        return true;
+      }
+      return false;
+    }
+  };
+
+  // Reads a grid or block shape, an integer or up to three of them.
+  auto launch_dims(py::handle dims, char const * what) -> std::array<unsigned int, 3>
+  {
+    std::array<unsigned int, 3> result{1, 1, 1};
+    if (py::isinstance<py::int_>(dims)) {
+      result[0] = dims.cast<unsigned int>();
+      return result;
+    }
+    auto const seq = dims.cast<std::vector<unsigned int>>();
+    if (seq.empty() || seq.size() > 3) {
+      throw std::invalid_argument(std::string(what) + " must have 1 to 3 dimensions");
+    }
+    std::copy(seq.begin(), seq.end(), result.begin());
+    return result;
+  }
+
+  void launch(
+      uintptr_t i_function, py::handle grid, py::handle block, StreamH const & h_stream
+    , py::args const & args, unsigned int shared_mem)
+  {
+    auto const g = launch_dims(grid, "grid");
+    auto const b = launch_dims(block, "block");
+    LaunchArgs packed(args);
+
+    py::gil_scoped_release nogil;
+    CUDA_CHECK(driver().cuLaunchKernel(
+        from_uintptr<CUfunction>(i_function), g[0], g[1], g[2], b[0], b[1], b[2]
+      , shared_mem, h_stream->res, packed.params.data(), nullptr));
+    g_launch_holds.add(h_stream, std::move(packed.holds));
+  }
+
+  // Times the GPU work queued on a stream between enter and exit, with
+  // pooled timing events. The elapsed time is read on the completion thread
+  // once the work completes, and added to the label's histogram in the
+  // diagnostics, so the host never synchronizes on the events.
+  struct StreamTimer
+  {
+    StreamH h_stream;
+    std::string label;
+    CUcontext ctx = nullptr;
+    CUevent start = nullptr;
+
+    void enter()
+    {
+      if (start) { throw std::runtime_error("Timer " + label + " is already running"); }
+      CUDA_CHECK(driver().cuCtxGetCurrent(&ctx));
+      auto const event = g_events.acquire(ctx, CU_EVENT_DEFAULT);
+      auto const result = driver().cuEventRecord(event, h_stream->res);
+      if (result != CUDA_SUCCESS) {
+        g_events.release(ctx, CU_EVENT_DEFAULT, event);
+        raise_cuda_error(result);
+      }
+      start = event;
+    }
+
+    void exit()
+    {
+      if (!start) { return; }
+      auto const begin = std::exchange(start, nullptr);
+      auto const end = g_events.acquire(ctx, CU_EVENT_DEFAULT);
+      auto const recycle = [ctx = ctx, begin, end]
+        {
+          g_events.release(ctx, CU_EVENT_DEFAULT, begin);
+          g_events.release(ctx, CU_EVENT_DEFAULT, end);
+        };
+      auto const result = driver().cuEventRecord(end, h_stream->res);
+      if (result != CUDA_SUCCESS) {
+        recycle();
+        raise_cuda_error(result);
+      }
+      g_completions.after(h_stream->res, [label = label, begin, end, recycle]
+        {
+          auto _ = on_scope_exit(recycle);
+          float ms = 0;
+          CUDA_CHECK(driver().cuEventElapsedTime(&ms, begin, end));
+          USAGE(record_timing(label, ms));
+        });
+    }
+  };
+
+  // Asyncio Completions
+  // ===================
+  //
+  // Awaitable completions, as asyncio futures. Waits are completion
+  // requests, so they all share the completion thread. Completed waits are
+  // queued for their event loop, which watches an eventfd with add_reader and
+  // resolves their futures on its own thread when woken. Each loop gets its
+  // notifier on first use, dropped once the loop is closed.
+  class LoopNotifier
+  {
+  public:
+    // The part the completion thread touches, free of Python objects.
+    class Wakeup
+    {
+    public:
+      Wakeup() : fd{eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)}
+      {
+        if (fd < 0) { throw std::system_error(errno, std::generic_category(), "eventfd"); }
+      }
+
+      Wakeup(Wakeup const &) = delete;
+      Wakeup & operator=(Wakeup const &) = delete;
+      ~Wakeup() { close(fd); }
+
+      void post(uint64_t id)
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        ready.push_back(id);
+        uint64_t const one = 1;
+        [[maybe_unused]] auto const n = write(fd, &one, sizeof(one));
+      }
+
+      auto take() -> std::vector<uint64_t>
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        uint64_t count = 0;
+        [[maybe_unused]] auto const n = read(fd, &count, sizeof(count));
+        return std::exchange(ready, {});
+      }
+
+      int const fd;
+
+    private:
+      std::mutex mutex;
+      std::vector<uint64_t> ready;
+    };
+
+    explicit LoopNotifier(py::object loop) : loop{std::move(loop)}
+    {
+      this->loop.attr("add_reader")(wakeup->fd, py::cpp_function([this] { this->drain(); }));
+    }
+
+    LoopNotifier(LoopNotifier const &) = delete;
+    LoopNotifier & operator=(LoopNotifier const &) = delete;
+
+    ~LoopNotifier()
+    {
+      if (!closed()) { loop.attr("remove_reader")(wakeup->fd); }
+    }
+
+    bool closed() const { return loop.attr("is_closed")().cast<bool>(); }
+
+    // Returns a future of the loop, resolved when request calls its argument.
+    // Called with the GIL held.
+    template<typename Request>
+    auto future(Request && request) -> py::object
+    {
+      auto future = loop.attr("create_future")();
+      auto const id = next_id++;
+      futures.emplace(id, future);
+      try {
+        request([wakeup = wakeup, id] { wakeup->post(id); });
+      } catch (...) {
+        futures.erase(id);
+        throw;
+      }
+      return future;
+    }
+
+    // Futures of the loop running in this thread, with the GIL held.
+    static auto running() -> LoopNotifier &
+    {
+      auto loop = py::module_::import("asyncio").attr("get_running_loop")();
+      for (auto it = notifiers.begin(); it != notifiers.end();) {
+        it = (*it)->closed() ? notifiers.erase(it) : std::next(it);
+      }
+      for (auto const & notifier : notifiers) {
+        if (notifier->loop.is(loop)) { return *notifier; }
+      }
+      notifiers.push_back(std::make_unique<LoopNotifier>(std::move(loop)));
+      return *notifiers.back();
+    }
+
+    // Drops every notifier, at interpreter exit.
+    static void clear() { notifiers.clear(); }
+
+  private:
+    void drain()
+    {
+      for (auto const id : wakeup->take()) {
+        auto it = futures.find(id);
+        if (it == futures.end()) { continue; }
+        auto const future = std::move(it->second);
+        futures.erase(it);
+        // Cancelled futures are done already.
+        if (!future.attr("done")().cast<bool>()) { future.attr("set_result")(py::none()); }
+      }
+    }
+
+    py::object loop;
+    std::shared_ptr<Wakeup> wakeup = std::make_shared<Wakeup>();
+    std::unordered_map<uint64_t, py::object> futures;
+    uint64_t next_id = 0;
+
+    static std::vector<std::unique_ptr<LoopNotifier>> notifiers;
+  };
+
+  std::vector<std::unique_ptr<LoopNotifier>> LoopNotifier::notifiers;
+
+  // Copies size bytes between allocations, on stream. Allocations on another
+  // device than the stream's are made accessible to it first, if the devices
+  // allow it; otherwise the driver stages the copy.
+  void copy(Deviceptr const & dst, Deviceptr const & src, size_t size, Stream const & stream)
+  {
+    for (auto const * buffer : {&dst, &src}) {
+      if (buffer->device == stream.device) { continue; }
+      if (!g_peers.enable(stream.device, buffer->device)) { continue; }
+      if (buffer->h_pool) {
+        g_peers.grant(buffer->h_pool->res, buffer->device, stream.device);
+      }
+    }
+    CUDA_CHECK(driver().cuMemcpyAsync(dst.res, src.res, size, stream.res));
+  }
+
+  // Stream Scheduler
+  // ================
+  //
+  // Owns streams in named priority classes, and hands them out to callers
+  // that ask for a stream of a class, round-robin or to the least loaded
+  // stream of the class. Callers report work they queue with `track`, which
+  // records a pooled event on the stream. A stream's queue depth is its
+  // number of tracked events that have not completed, found by querying
+  // them oldest first.
+  class StreamScheduler
+  {
+  public:
+    struct Class
+    {
+      std::string name;
+      int count;
+      int priority; // CUDA stream priority; lower is more urgent
+    };
+
+    enum class Policy { round_robin, least_loaded };
+
+    StreamScheduler(std::vector<Class> const & classes, Policy policy) : policy{policy}
+    {
+      CUDA_CHECK(driver().cuCtxGetCurrent(&ctx));
+      int least = 0, greatest = 0;
+      CUDA_CHECK(driver().cuCtxGetStreamPriorityRange(&least, &greatest));
+      for (auto const & c : classes) {
+        if (c.count < 1) { throw std::invalid_argument("Class " + c.name + " needs a stream"); }
+        auto & group = groups[c.name];
+        if (!group.lanes.empty()) { throw std::invalid_argument("Duplicate class " + c.name); }
+        auto const priority = std::clamp(c.priority, greatest, least);
+        for (int i = 0; i < c.count; ++i) {
+          CUstream stream = nullptr;
+          CUDA_CHECK(driver().cuStreamCreateWithPriority(&stream, CU_STREAM_NON_BLOCKING, priority));
+          group.lanes.push_back(Lane{Stream::capture(to_uintptr(stream)), priority, {}, 0});
+        }
+      }
+      for (auto & kv : groups) {
+        for (auto & lane : kv.second.lanes) { lanes[lane.h_stream->res] = &lane; }
+      }
+    }
+
+    StreamScheduler(StreamScheduler const &) = delete;
+    StreamScheduler & operator=(StreamScheduler const &) = delete;
+
+    ~StreamScheduler()
+    {
+      for (auto & kv : lanes) {
+        for (auto event : kv.second->inflight) {
+          g_events.release(ctx, CU_EVENT_DISABLE_TIMING, event);
+        }
+      }
+    }
+
+    auto acquire(std::string const & name) -> StreamH
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      auto it = groups.find(name);
+      if (it == groups.end()) { throw std::invalid_argument("No stream class named " + name); }
+      auto & group = it->second;
+      if (policy == Policy::round_robin) {
+        return group.lanes[group.next++ % group.lanes.size()].h_stream;
+      }
+      Lane * best = nullptr;
+      size_t best_depth = SIZE_MAX;
+      for (auto & lane : group.lanes) {
+        auto const depth = poll(lane);
+        if (depth < best_depth) { best = &lane; best_depth = depth; }
+        if (depth == 0) { break; }
+      }
+      return best->h_stream;
+    }
+
+    // Records that work was queued on stream, which must be one of ours.
+    void track(Stream const & stream)
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      auto it = lanes.find(stream.res);
+      if (it == lanes.end()) { throw std::invalid_argument("Stream is not from this scheduler"); }
+      auto & lane = *it->second;
+      poll(lane);
+      auto const event = g_events.acquire(ctx, CU_EVENT_DISABLE_TIMING);
+      auto const result = driver().cuEventRecord(event, stream.res);
+      if (result != CUDA_SUCCESS) {
+        g_events.release(ctx, CU_EVENT_DISABLE_TIMING, event);
+        raise_cuda_error(result);
+      }
+      lane.inflight.push_back(event);
+      lane.submitted += 1;
+    }
+
+    // Returns the queue depth of each stream, by class.
+    auto depths() -> std::map<std::string, std::vector<size_t>>
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      std::map<std::string, std::vector<size_t>> result;
+      for (auto & kv : groups) {
+        for (auto & lane : kv.second.lanes) { result[kv.first].push_back(poll(lane)); }
+      }
+      return result;
+    }
+
+    // Returns the number of tracked submissions to each stream, by class.
+    auto submitted() -> std::map<std::string, std::vector<long>>
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      std::map<std::string, std::vector<long>> result;
+      for (auto const & kv : groups) {
+        for (auto const & lane : kv.second.lanes) { result[kv.first].push_back(lane.submitted); }
+      }
+      return result;
+    }
+
+  private:
+    struct Lane
+    {
+      StreamH h_stream;
+      int priority;
+      std::deque<CUevent> inflight;
+      long submitted = 0;
+    };
+
+    struct Group
+    {
+      std::vector<Lane> lanes;
+      size_t next = 0;
+    };
+
+    // Retires the completed events of lane, returning its queue depth. Call
+    // with the mutex locked.
+    size_t poll(Lane & lane)
+    {
+      while (!lane.inflight.empty()) {
+        auto const result = driver().cuEventQuery(lane.inflight.front());
+        if (result == CUDA_ERROR_NOT_READY) { break; }
+        if (result != CUDA_SUCCESS) { raise_cuda_error(result); }
+        g_events.release(ctx, CU_EVENT_DISABLE_TIMING, lane.inflight.front());
+        lane.inflight.pop_front();
+      }
+      return lane.inflight.size();
+    }
+
+    CUcontext ctx = nullptr;
+    Policy policy;
+    std::mutex mutex;
+    std::map<std::string, Group> groups;
+    std::unordered_map<CUstream, Lane *> lanes;
+  };
+
+  // Returns a holder of h that also holds h_stream, for a box cached without
+  // holding its stream. The box is dropped before the stream.
+  template<typename Box>
+  auto holding_stream(std::shared_ptr<Box> h, StreamH h_stream) -> std::shared_ptr<Box>
+  {
+    struct Held
+    {
+      StreamH h_stream;
+      std::shared_ptr<Box> h;
+    };
+    auto held = std::make_shared<Held>(Held{std::move(h_stream), std::move(h)});
+    return std::shared_ptr<Box>(held, held->h.get());
+  }
+
+  // Library Handles
+  // ===============
+  //
+  // Math libraries such as cuBLAS and cuSOLVER have handles that are costly
+  // to create and are bound to a stream. A LibraryHandle box holds one
+  // handle of a library. It is created on first use for a (device, stream)
+  // pair, and cached until that stream is released. A library plugs in with
+  // a traits type following its create/setStream/destroy functions:
+  //
+  //     struct Cublas
+  //     {
+  //       using Handle = cublasHandle_t;
+  //       static constexpr char const * class_name = "CublasHandle";
+  //       static constexpr char const * name = "cublasHandle_t";
+  //       static Handle create();
+  //       static void set_stream(Handle handle, CUstream stream);
+  //       static void destroy(Handle handle);
+  //     };
+  //
+  // Handles are created in the current context, which should be that of the
+  // stream. The cache's own reference to a handle does not hold its stream,
+  // whose release drops the handle, but each holder returned by get() does.
+  template<typename Library>
+  struct LibraryHandle
+  {
+    using Handle = typename Library::Handle;
+    using Holder = std::shared_ptr<LibraryHandle>;
+
+    Handle res{};
+    CUstream stream = nullptr;
+    int device = 0;
+    static constexpr char const * class_name = Library::class_name;
+    static constexpr char const * cuda_resource_name = Library::name;
+
+    LibraryHandle() = default;
+    LibraryHandle(Handle res, CUstream stream, int device)
+      : res{res}, stream{stream}, device{device}
+    {}
+
+    uintptr_t as_int() const { return to_uintptr(res); }
+
+    // Returns the handle bound to h_stream, creating it if needed.
+    static auto get(StreamH const & h_stream) -> Holder
+    {
+      std::call_once(hooked, []{ Stream::on_release(&forget); });
+      auto const key = std::make_pair(h_stream->device, h_stream->res);
+      std::lock_guard<std::mutex> lock(mutex);
+      auto & h = handles[key];
+      if (!h) {
+        MESSAGE("Creating " << Library::name << " for Stream 0x" << std::hex << h_stream->as_int());
+        auto res = Library::create();
+        auto _ = on_scope_exit([&]{ if (!h) { Library::destroy(res); } });
+        Library::set_stream(res, h_stream->res);
+        h = Holder(new LibraryHandle(res, h_stream->res, h_stream->device), [](auto * box)
+          {
+            MESSAGE("Destroying " << Library::name << " 0x" << std::hex << box->as_int());
+            auto _ = on_scope_exit([=]{ delete box; });
+            Library::destroy(box->res);
+          });
+      }
+      return holding_stream(h, h_stream);
+    }
+
+  private:
+    static void forget(Stream const & stream)
+    {
+      Holder dropped;
+      std::lock_guard<std::mutex> lock(mutex);
+      auto it = handles.find(std::make_pair(stream.device, stream.res));
+      if (it == handles.end()) { return; }
+      dropped = std::move(it->second);
+      handles.erase(it);
+    }
+
+    static std::once_flag hooked;
+    static std::mutex mutex;
+    static std::map<std::pair<int, CUstream>, Holder> handles;
+  };
+
+  template<typename Library> std::once_flag LibraryHandle<Library>::hooked;
+  template<typename Library> std::mutex LibraryHandle<Library>::mutex;
+  template<typename Library>
+  std::map<std::pair<int, CUstream>, typename LibraryHandle<Library>::Holder>
+    LibraryHandle<Library>::handles;
+
+  // Workspaces
+  // ==========
+  //
+  // Scratch buffers for work on a stream, one per (device, stream, pool).
+  // Work on a stream is ordered, so successive users of the buffer share it
+  // without synchronizing. A request larger than the buffer replaces it with
+  // one of at least twice the size; the old buffer is freed on the stream
+  // once its last holder is gone. Workspaces are dropped when their stream
+  // is released, and idle ones when memory runs out. Each thread's
+  // per-thread default stream is a different stream, with its own
+  // workspaces, dropped when the thread exits.
+  //
+  // The cache's buffers free on a stream box that does not hold the stream,
+  // so that cached workspaces do not keep their streams alive. The holders
+  // returned by get() hold the caller's stream as well.
+  class WorkspaceCache
+  {
+  public:
+    // Returns a buffer of at least size bytes, for work on h_stream.
+    auto get(StreamH const & h_stream, MemPoolH const & h_pool, size_t size) -> DeviceptrH
+    {
+      auto const key = Key(h_stream->device, h_stream->res, stream_thread(h_stream->res), h_pool->res);
+      if (std::get<2>(key) != std::thread::id{}) {
+        thread_local ThreadExit thread_exit{this};
+      }
+      size_t capacity = size;
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = entries.find(key);
+        if (it != entries.end()) {
+          if (it->second.size >= size) {
+            hits += 1;
+            return holding_stream(it->second.buffer, h_stream);
+          }
+          capacity = std::max(size, 2 * it->second.size);
+        }
+      }
+
+      // Allocate unlocked, since running out of memory trims this cache.
+      MESSAGE("Growing workspace of Stream 0x" << std::hex << h_stream->as_int()
+              << " to 0x" << capacity << " bytes");
+      auto const h_borrowed = StreamH(new Stream(h_stream->res, h_stream->device));
+      auto buffer = Deviceptr::allocate(capacity, h_pool, h_borrowed);
+      allocations += 1;
+
+      DeviceptrH replaced;
+      std::lock_guard<std::mutex> lock(mutex);
+      auto & entry = entries[key];
+      if (entry.size >= capacity) { return holding_stream(entry.buffer, h_stream); }
+      replaced = std::exchange(entry.buffer, buffer);
+      entry.size = capacity;
+      return holding_stream(buffer, h_stream);
+    }
+
+    // Drops the workspaces of a stream about to be destroyed.
+    void forget(Stream const & stream)
+    {
+      drop_if([&](Key const & key, Entry const &)
+        {
+          return std::get<1>(key) == stream.res && std::get<0>(key) == stream.device;
+        });
+    }
+
+    // Drops workspaces not held outside the cache. Those of another thread's
+    // per-thread default stream are left to that thread, since they must be
+    // freed on its stream.
+    void trim()
+    {
+      auto const self = std::this_thread::get_id();
+      drop_if([&](Key const & key, Entry const & entry)
+        {
+          auto const thread = std::get<2>(key);
+          return entry.buffer.use_count() == 1 && (thread == std::thread::id{} || thread == self);
+        });
+    }
+
+    auto stats() -> std::map<std::string, long>
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      long bytes = 0;
+      for (auto const & kv : entries) { bytes += kv.second.size; }
+      return {
+          {"hits", hits.load()}
+        , {"allocations", allocations.load()}
+        , {"workspaces", long(entries.size())}
+        , {"bytes", bytes}
+        };
+    }
+
+  private:
+    // Device, stream, the thread of a per-thread default stream, and pool
+    using Key = std::tuple<int, CUstream, std::thread::id, CUmemoryPool>;
+
+    struct Entry
+    {
+      DeviceptrH buffer;
+      size_t size = 0;
+    };
+
+    // Drops the workspaces of the per-thread default stream of a thread
+    // when it exits, on that thread.
+    struct ThreadExit
+    {
+      WorkspaceCache * cache;
+
+      ~ThreadExit()
+      {
+        auto const self = std::this_thread::get_id();
+        cache->drop_if([&](Key const & key, Entry const &) { return std::get<2>(key) == self; });
+      }
+    };
+
+    static std::thread::id stream_thread(CUstream stream)
+    {
+      return stream == CU_STREAM_PER_THREAD ? std::this_thread::get_id() : std::thread::id{};
+    }
+
+    template<typename Predicate>
+    void drop_if(Predicate && predicate)
+    {
+      std::vector<DeviceptrH> dropped;
+      std::lock_guard<std::mutex> lock(mutex);
+      for (auto it = entries.begin(); it != entries.end();) {
+        if (predicate(it->first, it->second)) {
+          dropped.push_back(std::move(it->second.buffer));
+          it = entries.erase(it);
+        } else {
+          ++it;
+        }
+      }
+    }
+
+    std::mutex mutex;
+    std::map<Key, Entry> entries;
+    std::atomic<long> hits{0};
+    std::atomic<long> allocations{0};
+  } g_workspaces;
+
+  // A library following the create/setStream/destroy pattern, for tests. A
+  // handle is the stream it is bound to.
+  struct StandInLibrary
+  {
+    using Handle = CUstream *;
+    static constexpr char const * class_name = "LibraryHandle";
+    static constexpr char const * name = "StandInHandle";
+    static inline std::atomic<long> created{0};
+    static inline std::atomic<long> destroyed{0};
+
+    static Handle create() { created += 1; return new CUstream{}; }
+    static void set_stream(Handle handle, CUstream stream) { *handle = stream; }
+    static void destroy(Handle handle) { destroyed += 1; delete handle; }
+  };
+
+  // A box that counts its destructions, for testing sharded holders.
+  struct ShardedProbe
+  {
+    static inline std::atomic<long> destroyed{0};
+    ~ShardedProbe() { destroyed += 1; }
+  };
+
+  // Runs nthreads threads over one probe held by sharded holders, in three
+  // scenarios:
+  //
+  //   - copies_across_threads: every thread copies a holder made on the
+  //     calling thread, and copies and drops its own copies.
+  //   - foreign_drops: every thread drops the copies another thread made.
+  //   - thread_exit: the threads exit while their copies are still live;
+  //     other threads then copy and drop them.
+  //
+  // Returns whether, in each scenario, the probe stayed alive while held and
+  // was destroyed exactly once after the last holder was dropped.
+  auto check_sharded_holders(int nthreads, long iters)
+    -> std::map<std::string, bool>
+  {
+    using ProbeSH = ShardedH<ShardedProbe>;
+
+    auto on_threads = [nthreads](auto && body)
+      {
+        std::vector<std::thread> threads;
+        for (int t = 0; t < nthreads; ++t) { threads.emplace_back(body, t); }
+        for (auto & thread : threads) { thread.join(); }
+      };
+
+    std::map<std::string, bool> results;
+    auto scenario = [&](std::string const & name, auto && run)
+      {
+        auto const before = ShardedProbe::destroyed.load();
+        auto root = ProbeSH(new ShardedProbe{});
+        std::vector<std::vector<ProbeSH>> copies(nthreads);
+        run(root, copies);
+        root.reset();
+        bool const held = ShardedProbe::destroyed == before;
+        copies.clear();
+        results[name] = held && ShardedProbe::destroyed == before + 1;
+      };
+
+    scenario("copies_across_threads", [&](ProbeSH const & root, auto & copies)
+      {
+        on_threads([&](int t)
+          {
+            for (long i = 0; i < iters; ++i) {
+              ProbeSH a = root;
+              ProbeSH b = a;
+              if (i % 64 == 0) { copies[t].push_back(b); }
+            }
+          });
+      });
+
+    scenario("foreign_drops", [&](ProbeSH const & root, auto & copies)
+      {
+        on_threads([&](int t)
+          {
+            for (long i = 0; i < iters; ++i) { copies[t].push_back(root); }
+          });
+        std::vector<std::vector<ProbeSH>> kept(nthreads);
+        on_threads([&](int t)
+          {
+            auto & theirs = copies[(t + 1) % nthreads];
+            kept[t].push_back(theirs.front());
+            theirs.clear();
+          });
+        on_threads([&](int t) { kept[t].clear(); });
+        copies[0].push_back(root);
+      });
+
+    scenario("thread_exit", [&](ProbeSH const & root, auto & copies)
+      {
+        on_threads([&](int t)
+          {
+            for (long i = 0; i < iters; ++i) { copies[t].push_back(root); }
+          });
+        on_threads([&](int t)
+          {
+            auto & theirs = copies[(t + 1) % nthreads];
+            for (long i = 0; i < iters; ++i) { ProbeSH copy = theirs[i]; }
+            theirs.resize(1);
+          });
+      });
+
+    return results;
+  }
+
+  // Make a Python class wrapping a CUDA resource box that exposes the resource
+  // (as an integer), is showable and resettable, and provided make_static.
+  template<typename Box>
+  void reset_holder(std::shared_ptr<Box> & holder) { holder.reset(new Box{}); }
+
+  template<typename Box>
+  void reset_holder(SlotH<Box> & holder) { holder = Box::table.make(Box{}); }
+
+  template<typename Box, typename Holder = std::shared_ptr<Box>>
+  auto py_class(py::module & m)
+  {
+    // Reading a spillable buffer may bring it back to the device, so it
+    // releases the GIL.
+    auto as_int = [](Box const & self)
+      {
+        if constexpr (std::is_same_v<Box, SpillableDeviceptr>) {
+          py::gil_scoped_release nogil;
+          return self.as_int();
+        } else {
+          return self.as_int();
+        }
+      };
+    return py::class_<Box, Holder>(m, Box::class_name)
+      .def("__int__", as_int)
+      .def_property_readonly("value", as_int)
+      .def_property_readonly("device", [](Box const & self) { return self.device; })
+      .def("reset", [](Holder & self) { reset_holder(self); })
+      .def("__repr__", [=](Box const & self) {
+          std::ostringstream oss;
+          oss << Box::cuda_resource_name << "=0x" << std::hex << as_int(self);
+          return py::str(oss.str());
+      });
+  }
+
+  // The Python Deviceptr API, the same for both backends.
+  template<typename Box, typename Holder = std::shared_ptr<Box>>
+  auto py_deviceptr_class(py::module & m)
+  {
+    return py_class<Box, Holder>(m)
+      .def_static("allocate", &Box::allocate
+        , py::arg("size"), py::arg("pool"), py::arg("stream")
+        , py::call_guard<py::gil_scoped_release>()
+        )
+      .def_static("capture", &Box::capture
+        , py::arg("res"), py::arg("pool"), py::arg("stream"), py::arg("size") = 0
+        )
+      .def_property_readonly("size", [](Box const & self) { return self.size; })
+      .def_static("capture_static", &Box::capture_static)
+      .def("set_stream", [](Holder const & h_devp, StreamH const & h_stream)
+          { h_devp->h_stream = h_stream; })
+      .def("slice", [](Holder const & h_devp, size_t offset, size_t size)
+          {
+            return DeviceptrSlice::make(h_devp, offset, size);
+          }
+        , py::arg("offset"), py::arg("size")
+        , "Returns a view of size bytes of this allocation, from offset, which holds it."
+        )
+      .def("release_after", [](Holder const & h_devp, StreamH const & h_stream)
+          { release_after(h_stream, std::vector<Holder>{h_devp}); }
+        , py::arg("stream")
+        , "Holds this allocation until the work queued so far on stream completes."
+        )
+      ;
+  }
+
+  // Benchmarks
+  // ==========
+
+  // Stand-in for Deviceptr, parameterized by owner holder type, so that
+  // plain and sharded owners are measured with the same box layout.
+  template<typename PoolHolder, typename StreamHolder>
+  struct OwnedBuffer
+  {
+    CUdeviceptr res = 0;
+    PoolHolder h_pool;
+    StreamHolder h_stream;
+  };
+
+  // Each of nthreads threads captures iters buffers into a ring of live
+  // buffers, all owned by one memory pool and one stream. As in
+  // Deviceptr::capture, each buffer's owner holders are made from plain
+  // holders, so sharded owners pay for finding their thread's shard. Returns
+  // the mean time per capture in nanoseconds.
+  template<typename PoolHolder, typename StreamHolder>
+  double bench_shared_owners(int nthreads, long iters)
+  {
+    using Buffer = OwnedBuffer<PoolHolder, StreamHolder>;
+    constexpr size_t ring_size = 64;
+
+    auto const h_pool = MemPool::capture_static(0x1000);
+    auto const h_stream = Stream::capture_static(0x2000);
+
+    std::atomic<int> waiting{nthreads};
+    std::vector<double> elapsed(nthreads);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < nthreads; ++t) {
+      threads.emplace_back([&, t]
+        {
+          std::vector<Buffer> ring(ring_size);
+
+          waiting.fetch_sub(1);
+          while (waiting.load() != 0) {}
+
+          auto const start = std::chrono::steady_clock::now();
+          for (long i = 0; i < iters; ++i) {
+            ring[i % ring_size] = Buffer{static_cast<CUdeviceptr>(i), PoolHolder{h_pool}, StreamHolder{h_stream}};
+          }
+          auto const stop = std::chrono::steady_clock::now();
+          elapsed[t] = std::chrono::duration<double, std::nano>(stop - start).count();
+        });
+    }
+    for (auto & thread : threads) { thread.join(); }
+
+    double total = 0;
+    for (auto e : elapsed) { total += e; }
+    return total / (static_cast<double>(nthreads) * iters);
+  }
+
+  // Registers one host buffer of nbytes iters times, releasing each
+  // registration before the next. Uncached, each is a driver registration.
+  // Cached, a registration of the buffer is held throughout, as a pipeline
+  // reusing the buffer would, and each is served by the cache. Returns the
+  // mean time per registration in nanoseconds.
+  double bench_host_registration(size_t nbytes, long iters, bool cached)
+  {
+    auto const buffer = std::make_unique<char[]>(nbytes);
+    auto const addr = to_uintptr(buffer.get());
+
+    HostRegistrationH held;
+    if (cached) { held = HostRegistration::acquire(addr, nbytes, 0); }
+
+    auto const start = std::chrono::steady_clock::now();
+    for (long i = 0; i < iters; ++i) {
+      if (cached) {
+        HostRegistration::acquire(addr, nbytes, 0);
+      } else {
+        CUDA_CHECK(driver().cuMemHostRegister(buffer.get(), nbytes, 0));
+        CUDA_CHECK(driver().cuMemHostUnregister(buffer.get()));
+      }
+    }
+    auto const stop = std::chrono::steady_clock::now();
+    return std::chrono::duration<double, std::nano>(stop - start).count() / iters;
+  }
+
+  // A kernel for the stub driver, which runs kernels on the host.
+  void bench_noop_kernel(void **) {}
+
+  // Launches a kernel iters times on a non-default stream, with a Deviceptr
+  // and an integer argument, which it must ignore. The launches go through
+  // launch, which packs the arguments and holds the Deviceptr until the
+  // launch completes, or else straight to cuLaunchKernel with parameters
+  // packed once. The function defaults to a no-op for the stub driver.
+  // Returns the mean nanoseconds per launch. Call with the GIL held.
+  double bench_launch(long iters, bool holders, uintptr_t i_function)
+  {
+    if (!i_function) { i_function = to_uintptr(&bench_noop_kernel); }
+    auto const h_stream = Stream::capture_static(0x3000);
+    auto const h_buffer = Deviceptr::capture_static(0x4000);
+    auto const args = py::reinterpret_steal<py::args>(py::make_tuple(h_buffer, 7).release());
+    auto const one = py::int_(1);
+    auto res = h_buffer->res;
+    uint64_t value = 7;
+    void * params[] = {&res, &value};
+
+    auto const start = std::chrono::steady_clock::now();
+    for (long i = 0; i < iters; ++i) {
+      if (holders) {
+        launch(i_function, one, one, h_stream, args, 0);
+      } else {
+        CUDA_CHECK(driver().cuLaunchKernel(
+            from_uintptr<CUfunction>(i_function), 1, 1, 1, 1, 1, 1
+          , 0, h_stream->res, params, nullptr));
+      }
+    }
+    auto const stop = std::chrono::steady_clock::now();
+    g_completions.flush();
+    return std::chrono::duration<double, std::nano>(stop - start).count() / iters;
+  }
+
+  // Bytes currently allocated through malloc, as reported by the allocator.
+  size_t heap_bytes()
+  {
+    auto const info = mallinfo2();
+    return info.uordblks + info.hblkhd;
+  }
+
+  size_t rss_bytes()
+  {
+    size_t pages = 0, resident = 0;
+    std::ifstream("/proc/self/statm") >> pages >> resident;
+    return resident * static_cast<size_t>(sysconf(_SC_PAGESIZE));
+  }
+
+  struct Footprint
+  {
+    double heap = 0;
+    double rss = 0;
+  };
+
+  // Heap and resident bytes per item kept alive by make(i), for i in [0, n).
+  template<typename Make>
+  auto measure_footprint(long n, Make && make) -> Footprint
+  {
+    std::vector<decltype(make(0))> items;
+    items.reserve(n);
+    auto const heap0 = static_cast<double>(heap_bytes());
+    auto const rss0 = static_cast<double>(rss_bytes());
+    for (long i = 0; i < n; ++i) { items.push_back(make(i)); }
+    return {
+        (static_cast<double>(heap_bytes()) - heap0) / n
+      , (static_cast<double>(rss_bytes()) - rss0) / n
+      };
+  }
+
+  using FootprintLayers = std::map<std::string, double>;
+
+  // Per-layer bytes for n live holders of Box made like Box::capture does,
+  // with or without the registry entry capture makes. Owners are passed to
+  // every box.
+  template<typename Box, typename ... Owners>
+  auto bench_footprint(long n, bool cached, Owners const & ... owners) -> FootprintLayers
+  {
+    using Holder = std::shared_ptr<Box>;
+    auto const res = [](long i) { return from_uintptr<decltype(Box::res)>(0x1000 + i); };
+    auto const make_holder = [&](long i)
+      {
+        return Holder(new Box(res(i), owners...), [](auto * box) { delete box; });
+      };
+
+    auto const box = measure_footprint(n, [&](long i)
+      {
+        return std::make_unique<Box>(res(i), owners...);
+      });
+    auto const holder = measure_footprint(n, make_holder);
+    auto total = holder;
+    if (cached) {
+      auto cache = std::make_unique<Cache<Box>>();
+      total = measure_footprint(n, [&](long i)
+        {
+          return cache->find_or_insert(
+              to_uintptr(res(i)), [] { return 0; }, [&](int) { return make_holder(i); }
+            );
+        });
+    }
+    return {
+        {"holder", sizeof(Holder)}
+      , {"box", box.heap}
+      , {"control_block", holder.heap - box.heap}
+      , {"cache_node", total.heap - holder.heap}
+      , {"heap_per_holder", total.heap}
+      , {"rss_per_holder", total.rss}
+      };
+  }
+
+  // Captures i_res as Box::capture does, through the registry, into a
+  // holder that destroys nothing, so that made-up handles can be measured
+  // from Python.
+  template<typename Box, typename ... Owners>
+  auto capture_inert(uintptr_t i_res, Owners const & ... owners) -> std::shared_ptr<Box>
+  {
+    return Box::cache.find_or_insert(i_res, [] { return 0; }, [&](int)
+      {
+        auto * box = new Box(from_uintptr<decltype(Box::res)>(i_res), owners...);
+        return std::shared_ptr<Box>(box, [](auto * box)
+          {
+            auto _ = on_scope_exit([=]{ delete box; });
+            Box::cache.erase_expired(box->as_int(), box->device);
+          });
+      });
+  }
+
+  // As above, for the slot-table backend. Slot chunks are amortized over
+  // the boxes they hold, and are reused once allocated.
+  auto bench_slot_footprint(long n, MemPoolH const & h_pool, StreamH const & h_stream)
+    -> FootprintLayers
+  {
+    auto const total = measure_footprint(n, [&](long i)
+      {
+        return SlotDeviceptr::table.make(SlotDeviceptr(0x1000 + i, h_pool, h_stream));
+      });
+    return {
+        {"holder", sizeof(SlotDeviceptrH)}
+      , {"box", total.heap}
+      , {"control_block", 0}
+      , {"cache_node", 0}
+      , {"heap_per_holder", total.heap}
+      , {"rss_per_holder", total.rss}
+      };
+  }
+}
+
+
+PYBIND11_DECLARE_HOLDER_TYPE(Box, ShardedH<Box>)
+PYBIND11_DECLARE_HOLDER_TYPE(Box, SlotH<Box>)
+
+
+PYBIND11_MODULE(cuda_core_holders_demo, m)
+{
+  m.doc() = "Provides CUDA resource holders";
+
+  m.def("load_driver", [](std::string const & path) { Driver::load(path); }
+    , py::arg("path")
+    , "Loads the CUDA driver at path. Must come before any use of the driver,\n"
+      "which otherwise loads $CUDA_HOLDERS_DRIVER or libcuda.so.1."
+    );
+  m.def("driver_path", []() -> std::optional<std::string>
+      {
+        auto const * driver = Driver::loaded();
+        return driver ? std::optional<std::string>(driver->path) : std::nullopt;
+      }
+    , "Returns the path of the loaded CUDA driver, or None before its first use."
+    );
+
+  #ifdef ENABLE_DIAGNOSTICS
+  m.def("report_usage", [](){ g_usage.report(); });
+  m.def("usage", [](std::optional<int> device) { return g_usage.counts(device); }
+    , py::arg("device") = py::none()
+    , "Returns the numbers of CUDA resources currently in use, on device or in total."
+    );
+  m.def("timings", []()
+      {
+        py::dict result;
+        for (auto const & [label, h] : g_usage.timing_histograms()) {
+          py::dict d;
+          d["count"] = py::cast(h.count);
+          d["total_ms"] = py::cast(h.total_ms);
+          d["min_ms"] = py::cast(h.min_ms);
+          d["max_ms"] = py::cast(h.max_ms);
+          d["buckets_us_log2"] = py::cast(std::vector<long>(h.buckets.begin(), h.buckets.end()));
+          result[py::str(label)] = d;
+        }
+        return result;
+      }
+    , "Returns histograms of GPU time of timed stream regions, by label."
+    );
+  m.def("front_cache_stats", [](){ return g_usage.front_cache_totals(); }
+    , "Returns hit, miss and invalidation counts of the per-thread front caches."
+    );
+  #endif
+
+  py_class<Stream>(m)
+    .def_static("capture", &Stream::capture)
+    .def_static("capture_static", &Stream::capture_static)
+    .def("retain_until_complete", [](Stream const & self, py::args objs)
+        {
+          g_completions.after(self.res, {}, std::move(objs));
+        }
+      , "Keeps the arguments alive until the work queued so far on this stream completes."
+      )
+    .def("timed", [](StreamH const & h_stream, std::string label)
+        {
+          return StreamTimer{h_stream, std::move(label)};
+        }
+      , py::arg("label")
+      , "Returns a context manager timing the GPU work queued on this stream within it."
+      )
+    .def("completed", [](Stream const & self)
+        {
+          return LoopNotifier::running().future([&](auto done)
+            {
+              g_completions.after(self.res, std::move(done));
+            });
+        }
+      , "Returns an asyncio future, resolved once the work queued so far on this\n"
+        "stream completes. Must be called from a running event loop."
+      )
+    ;
+
+  py_class<Event>(m)
+    .def_static("capture", &Event::capture)
+    .def_static("capture_static", &Event::capture_static)
+    .def("record", &Event::record, py::arg("stream"))
+    .def("completed", [](EventH const & h_event)
+        {
+          return LoopNotifier::running().future([&](auto done)
+            {
+              g_completions.after(h_event, std::move(done));
+            });
+        }
+      , "Returns an asyncio future, resolved once the work recorded in this event\n"
+        "completes. Must be called from a running event loop."
+      )
+    ;
+
+  py_class<HostRegistration>(m)
+    .def_static("register", [](uintptr_t addr, size_t size, unsigned int flags)
+        {
+          return HostRegistration::acquire(addr, size, flags);
+        }
+      , py::arg("addr"), py::arg("size"), py::arg("flags") = 0
+      , py::call_guard<py::gil_scoped_release>()
+      , "Page-locks size bytes of host memory from addr, reusing live registrations\n"
+        "that cover it, which must have the same flags. The memory must outlive\n"
+        "the registration."
+      )
+    .def_static("register", [](py::buffer buffer, unsigned int flags)
+        {
+          auto exported = std::shared_ptr<Py_buffer>(new Py_buffer{}, [](Py_buffer * view)
+            {
+              py::gil_scoped_acquire gil;
+              PyBuffer_Release(view);
+              delete view;
+            });
+          if (PyObject_GetBuffer(buffer.ptr(), exported.get(), PyBUF_C_CONTIGUOUS) != 0) {
+            throw py::error_already_set();
+          }
+          auto const addr = to_uintptr(exported->buf);
+          auto const size = static_cast<size_t>(exported->len);
+          py::gil_scoped_release nogil;
+          return HostRegistration::holding(HostRegistration::acquire(addr, size, flags), std::move(exported));
+        }
+      , py::arg("buffer"), py::arg("flags") = 0
+      , "Page-locks the memory of a C-contiguous buffer, such as a numpy array,\n"
+        "which the registration holds."
+      )
+    .def_static("registered", &HostRegistration::registered
+      , "Returns the address and size of each live registration."
+      )
+    .def_property_readonly("size", [](HostRegistration const & self) { return self.size; })
+    .def_property_readonly("flags", [](HostRegistration const & self) { return self.flags; })
+    .def_property_readonly("parts", [](HostRegistration const & self) { return self.parts; })
+    ;
+
+  py::class_<StreamTimer>(m, "StreamTimer")
+    .def("__enter__", [](StreamTimer & self) -> StreamTimer & { self.enter(); return self; }
+      , py::return_value_policy::reference_internal)
+    .def("__exit__", [](StreamTimer & self, py::args) { self.exit(); return false; })
+    .def_readonly("label", &StreamTimer::label)
+    ;
+
+  // Complete pending work while Python is still able to drop objects.
+  py::module_::import("atexit").attr("register")(
+      py::cpp_function([]() { g_completions.shutdown(); LoopNotifier::clear(); })
+    );
+
+  py_class<MemPool>(m)
+    .def_static("capture", [](uintptr_t i_res, std::optional<int> device)
+        {
+          return device ? MemPool::capture(i_res, *device) : MemPool::capture(i_res);
+        }
+      , py::arg("res"), py::arg("device") = py::none()
+      , "Captures a memory pool of device, by default the current device."
+      )
+    .def_static("capture_cached", (MemPoolH(*)(uintptr_t)) &capture_cached<MemPool>)
+    .def_static("capture_static", &MemPool::capture_static)
+    .def("set_spill_budget", &SpillableDeviceptr::set_budget, py::arg("nbytes")
+      , py::call_guard<py::gil_scoped_release>()
+      , "Sets the bytes spillable buffers from this pool may keep resident.")
+    .def_property_readonly("spill_resident_bytes", &SpillableDeviceptr::resident_bytes)
+    .def("grant_access", [](MemPool const & self, int peer)
+        {
+          return g_peers.grant(self.res, self.device, peer);
+        }
+      , py::arg("device"), py::call_guard<py::gil_scoped_release>()
+      , "Grants device access to allocations from this pool. Returns whether it is possible."
+      )
+    ;
+
+  py_deviceptr_class<Deviceptr>(m);
+
+  py_class<DeviceptrSlice, DeviceptrSliceH>(m)
+    .def("slice", [](DeviceptrSlice const & self, size_t offset, size_t size)
+        {
+          return DeviceptrSlice::make(self, offset, size);
+        }
+      , py::arg("offset"), py::arg("size")
+      , "Returns a view of size bytes of this slice, from offset."
+      )
+    .def_property_readonly("size", [](DeviceptrSlice const & self) { return self.size; })
+    .def_property_readonly("parent", [](DeviceptrSlice const & self)
+        {
+          return self.h_slot_parent ? py::cast(self.h_slot_parent) : py::cast(self.h_parent);
+        })
+    ;
+
+  m.def("enable_owner_index", [](bool enabled) { g_owners.set_enabled(enabled); }
+    , py::arg("enabled") = true
+    , "Indexes allocations captured from now on with their size, for find_owner."
+    );
+  m.def("find_owner", [](uintptr_t addr) { return g_owners.find(static_cast<CUdeviceptr>(addr)); }
+    , py::arg("addr")
+    , py::call_guard<py::gil_scoped_release>()
+    , "Returns the indexed Deviceptr whose allocation contains addr, or None."
+    );
+
+  m.def("copy", &copy
+    , py::arg("dst"), py::arg("src"), py::arg("size"), py::arg("stream")
+    , py::call_guard<py::gil_scoped_release>()
+    , "Copies between device allocations, enabling peer access if needed."
+    );
+  m.def("enable_peer_access", [](int device, int peer) { return g_peers.enable(device, peer); }
+    , py::arg("device"), py::arg("peer")
+    , py::call_guard<py::gil_scoped_release>()
+    , "Enables access from device to the memory of peer. Returns whether it is possible."
+    );
+
+  m.def("launch", &launch
+    , py::arg("function"), py::arg("grid"), py::arg("block"), py::arg("stream")
+    , py::arg("shared_mem") = 0
+    , "Launches a kernel on stream, with arguments passed as holders of device\n"
+      "memory, ints (as 64-bit words) or buffers such as numpy or ctypes scalars\n"
+      "and bytes, passed verbatim. Bare floats are rejected, as their width is\n"
+      "ambiguous. The holders are held until the launch completes."
+    );
+  m.def("launch_holds_waiting", []() { return g_launch_holds.waiting(); }
+    , py::call_guard<py::gil_scoped_release>()
+    , "Returns the number of launch argument holders waiting for a completion request."
+    );
+
+  m.def("release_after", [](StreamH const & h_stream, py::args buffers)
+      {
+        std::vector<DeviceptrH> holders;
+        std::vector<SlotDeviceptrH> slot_holders;
+        for (auto const & buffer : buffers) {
+          if (py::isinstance<SlotDeviceptr>(buffer)) {
+            slot_holders.push_back(py::cast<SlotDeviceptrH>(buffer));
+          } else {
+            holders.push_back(py::cast<DeviceptrH>(buffer));
+          }
+        }
+        if (!holders.empty()) { release_after(h_stream, std::move(holders)); }
+        if (!slot_holders.empty()) { release_after(h_stream, std::move(slot_holders)); }
+      }
+    , "Holds the Deviceptr arguments, of either backend, until the work queued so\n"
+      "far on stream completes."
+    );
+
+  // Pending releases are deferred frees, for the reclaim chain.
+  g_reclaim.add_flusher([]() { g_completions.flush(); });
+  g_reclaim.add_flusher([]() { g_capture_frees.flush(); });
+  g_reclaim.add_flusher([]() { g_workspaces.trim(); });
+  Stream::on_release([](Stream const & stream) { g_workspaces.forget(stream); });
+
+  m.def("workspace", [](StreamH const & h_stream, size_t size, MemPoolH const & h_pool)
+      {
+        return g_workspaces.get(h_stream, h_pool, size);
+      }
+    , py::arg("stream"), py::arg("size"), py::arg("pool")
+    , py::call_guard<py::gil_scoped_release>()
+    , "Returns a scratch buffer of at least size bytes for work on stream, reused\n"
+      "across calls on that stream."
+    );
+  m.def("workspace_stats", []() { return g_workspaces.stats(); });
+
+  py_class<GraphExec>(m)
+    .def_static("capture", &GraphExec::capture, py::arg("res"), py::arg("stream") = StreamH{}
+      , "Captures an instantiated graph. Allocations released while stream was being\n"
+        "captured are kept until the GraphExec is released.")
+    .def_property_readonly("adopted", [](GraphExec const & self)
+        {
+          return self.adopted ? self.adopted->size() : 0;
+        })
+    ;
+  m.def("flush_capture_deferred", []() { return g_capture_frees.flush(); }
+    , py::call_guard<py::gil_scoped_release>()
+    , "Frees allocations released during a stream capture that has since ended."
+    );
+
+  py_class<SpillableDeviceptr>(m)
+    .def_static("allocate", &SpillableDeviceptr::allocate
+      , py::arg("size"), py::arg("pool"), py::arg("stream")
+      , py::call_guard<py::gil_scoped_release>()
+      )
+    .def("set_stream", [](SpillableDeviceptrH const & h_devp, StreamH const & h_stream)
+        { h_devp->h_stream = h_stream; })
+    .def("spill", [](SpillableDeviceptr const & self)
+        {
+          if (!self.state) { return; }
+          std::lock_guard<std::recursive_mutex> lock(self.state->budget->mutex);
+          SpillableDeviceptr::spill(self);
+        }
+      , py::call_guard<py::gil_scoped_release>())
+    .def_property_readonly("spilled", &SpillableDeviceptr::spilled)
+    .def_property_readonly("size", &SpillableDeviceptr::size)
+    ;
+
+  using PrefetchArgs = std::tuple<ManagedPtrH, size_t, size_t, int>;
+  using AdviceArgs = std::tuple<ManagedPtrH, size_t, size_t, int, int>;
+  py_class<ManagedPtr>(m)
+    .def_static("allocate", &ManagedPtr::allocate, py::arg("size")
+      , py::call_guard<py::gil_scoped_release>())
+    .def_static("prefetch", [](std::vector<PrefetchArgs> const & ranges, Stream const & stream)
+        {
+          std::vector<ManagedPtr::Prefetch> batch;
+          for (auto const & [h_ptr, offset, size, device] : ranges) {
+            batch.push_back({h_ptr, offset, size, device});
+          }
+          py::gil_scoped_release nogil;
+          return ManagedPtr::prefetch(batch, stream);
+        }
+      , py::arg("ranges"), py::arg("stream")
+      , "Prefetches (ptr, offset, size, device) ranges on stream, with device -1 for\n"
+        "the host. Returns the number of prefetches issued; a range already prefetched\n"
+        "to the same device earlier in the batch is skipped."
+      )
+    .def_static("advise", [](std::vector<AdviceArgs> const & ranges)
+        {
+          std::vector<ManagedPtr::Advice> batch;
+          for (auto const & [h_ptr, offset, size, advice, device] : ranges) {
+            batch.push_back({h_ptr, offset, size, static_cast<CUmem_advise>(advice), device});
+          }
+          py::gil_scoped_release nogil;
+          return ManagedPtr::advise(batch);
+        }
+      , py::arg("ranges")
+      , "Applies CUmem_advise values to (ptr, offset, size, advice, device) ranges.\n"
+        "Returns the number of calls issued."
+      )
+    .def_property_readonly("size", [](ManagedPtr const & self) { return self.size; })
+    ;
+
+  py::class_<StreamScheduler, std::shared_ptr<StreamScheduler>>(m, "StreamScheduler")
+    .def(py::init([](std::vector<std::tuple<std::string, int, int>> const & classes
+                   , std::string const & policy)
+        {
+          std::vector<StreamScheduler::Class> cs;
+          for (auto const & [name, count, priority] : classes) { cs.push_back({name, count, priority}); }
+          if (policy == "round_robin") {
+            return std::make_shared<StreamScheduler>(cs, StreamScheduler::Policy::round_robin);
+          }
+          if (policy == "least_loaded") {
+            return std::make_shared<StreamScheduler>(cs, StreamScheduler::Policy::least_loaded);
+          }
+          throw std::invalid_argument("No scheduling policy named " + policy);
+        })
+      , py::arg("classes"), py::arg("policy") = "least_loaded"
+      , "Creates streams for (name, count, priority) classes, handed out per policy:\n"
+        "'round_robin' or 'least_loaded'."
+      )
+    .def("acquire", &StreamScheduler::acquire, py::arg("name")
+      , py::call_guard<py::gil_scoped_release>()
+      , "Returns a stream of the named class.")
+    .def("track", &StreamScheduler::track, py::arg("stream")
+      , py::call_guard<py::gil_scoped_release>()
+      , "Records that work was queued on stream, for its queue depth.")
+    .def("depths", &StreamScheduler::depths, py::call_guard<py::gil_scoped_release>()
+      , "Returns the queue depth of each stream, by class.")
+    .def("submitted", &StreamScheduler::submitted
+      , "Returns the number of tracked submissions to each stream, by class.")
+    ;
+
+  auto slots = m.def_submodule("slots", "Holders backed by a slot table");
+
+  py_deviceptr_class<SlotDeviceptr, SlotDeviceptrH>(slots);
+
+  slots.def("live", []()
+      {
+        std::vector<uintptr_t> values;
+        SlotDeviceptr::table.for_each([&](auto const & box)
+          {
+            values.push_back(box.as_int());
+          });
+        return values;
+      }
+    , "Returns the handles of all live slot Deviceptrs, in slot order."
+    );
+
+  m.def("load_file", &load_file
+    , py::arg("path"), py::arg("dst"), py::arg("stream")
+    , py::arg("dst_offset") = 0, py::arg("file_offset") = 0, py::arg("length") = 0
+    , py::arg("chunk_size") = size_t{4} << 20, py::arg("nbuffers") = 3
+    , py::call_guard<py::gil_scoped_release>()
+    , "Streams a file region into a Deviceptr through pinned staging buffers."
+    );
+
+  auto reclaim = m.def_submodule("reclaim", "Reclaim-and-retry on out-of-memory");
+
+  reclaim.def("enabled", []() { return g_reclaim.enabled(); }
+    , "Returns the names of the enabled reclaim stages, in order.");
+  reclaim.def("set_enabled", [](std::vector<std::string> const & names)
+      { g_reclaim.set_enabled(names); }
+    , py::arg("names")
+    , "Enables the named stages (flush_deferred, spill, trim_pools, gc) only.");
+  reclaim.def("stats", []() { return g_reclaim.stats(); }
+    , "Returns attempt and recovery counts per stage, and failures.");
+
+  auto testing = m.def_submodule("testing", "Stand-ins for testing");
+
+  using StandInHandle = LibraryHandle<StandInLibrary>;
+  py_class<StandInHandle>(testing)
+    .def_static("get", &StandInHandle::get, py::arg("stream")
+      , "Returns the stand-in library handle bound to stream.")
+    .def_property_readonly("stream", [](StandInHandle const & self)
+        {
+          return self.res ? to_uintptr(*self.res) : 0;
+        })
+    ;
+  testing.def("library_handles", []()
+      {
+        return std::map<std::string, long>{
+            {"created", StandInLibrary::created}
+          , {"destroyed", StandInLibrary::destroyed}
+          };
+      }
+    , "Returns the numbers of stand-in library handles created and destroyed."
+    );
+  testing.def("sharded_holders", [](int nthreads, long iters)
+      {
+        py::gil_scoped_release nogil;
+        return check_sharded_holders(nthreads, iters);
+      }
+    , py::arg("nthreads"), py::arg("iters")
+    , "Checks the sharded holder reference counts across threads."
+    );
+
+  auto bench = m.def_submodule("bench", "Holder benchmarks");
+
+  bench.def("shared_owners", [](int nthreads, long iters, bool sharded)
+      {
+        py::gil_scoped_release nogil;
+        return sharded
+          ? bench_shared_owners<MemPoolSH, StreamSH>(nthreads, iters)
+          : bench_shared_owners<MemPoolH, StreamH>(nthreads, iters);
+      }
+    , py::arg("nthreads"), py::arg("iters"), py::arg("sharded")
+    );
+
+  bench.def("footprint", [](std::string const & type, long n, bool cached)
+      {
+        auto const h_pool = MemPool::capture_static(0x1000);
+        auto const h_stream = Stream::capture_static(0x2000);
+        if (type == "Stream") { return bench_footprint<Stream>(n, cached); }
+        if (type == "MemPool") { return bench_footprint<MemPool>(n, cached); }
+        if (type == "Deviceptr") {
+          return bench_footprint<Deviceptr>(n, cached, h_pool, h_stream);
+        }
+        if (type == "slots.Deviceptr" && !cached) {
+          return bench_slot_footprint(n, h_pool, h_stream);
+        }
+        throw std::invalid_argument("No footprint benchmark for " + type);
+      }
+    , py::arg("type"), py::arg("n"), py::arg("cached")
+    , "Returns per-layer bytes per live holder of the given type."
+    );
+  bench.def("host_registration", &bench_host_registration
+    , py::arg("nbytes"), py::arg("iters"), py::arg("cached")
+    , py::call_guard<py::gil_scoped_release>()
+    , "Returns the mean nanoseconds per registration of one host buffer."
+    );
+  bench.def("capture", [](std::string const & type, uintptr_t res) -> py::object
+      {
+        static auto const h_pool = MemPool::capture_static(0x1000);
+        static auto const h_stream = Stream::capture_static(0x2000);
+        if (type == "Stream") { return py::cast(capture_inert<Stream>(res)); }
+        if (type == "MemPool") { return py::cast(capture_inert<MemPool>(res)); }
+        if (type == "Deviceptr") { return py::cast(capture_inert<Deviceptr>(res, h_pool, h_stream)); }
+        throw std::invalid_argument("No registry capture benchmark for " + type);
+      }
+    , py::arg("type"), py::arg("res")
+    , "Captures res through the registry of type, like capture, into a holder\n"
+      "that destroys nothing."
+    );
+  bench.def("launch", &bench_launch
+    , py::arg("iters"), py::arg("holders"), py::arg("function") = 0
+    , "Returns the mean nanoseconds per launch of a kernel that ignores its\n"
+      "Deviceptr and int arguments, through launch or straight to the driver."
+    );
+  bench.def("heap_bytes", &heap_bytes);
+  bench.def("rss_bytes", &rss_bytes);
 }
 
@@ -0,0 +1,357 @@
+// Stub CUDA driver
+// ================
+//
+// A stand-in for libcuda.so.1 that runs on the host, for testing the holders
+// module on machines without a GPU. Build it with `./build.sh stub`, then put
+// the stub directory first on the library path:
+//
+//     LD_LIBRARY_PATH=stub python test_stub_driver.py
+//
+// Device memory is host memory, so device pointers can be read and written
+// directly from tests, and kernels are host functions. Work is performed
+// synchronously when it is issued, so streams are always idle and events
+// always complete. Set STUB_CUDA_DEVICE_BYTES to limit device memory, to
+// exercise out-of-memory handling. Set STUB_CUDA_DEVICE_COUNT to report
+// several devices, which all share one memory and one context, and are all
+// peers of each other.
+
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <cuda.h>
+#include <dlfcn.h>
+#include <map>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+
+namespace
+{
+  struct Device
+  {
+    std::mutex mutex;
+    std::unordered_map<CUdeviceptr, size_t> allocations;
+    std::unordered_set<CUstream> capturing;
+    std::map<uintptr_t, size_t> registered; // host registrations, by address
+    size_t capacity = SIZE_MAX;
+    size_t used = 0;
+
+    Device()
+    {
+      if (auto const * env = std::getenv("STUB_CUDA_DEVICE_BYTES")) {
+        capacity = std::stoull(env);
+      }
+    }
+
+    CUresult allocate(CUdeviceptr * dptr, size_t size)
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      if (size > capacity - used) { return CUDA_ERROR_OUT_OF_MEMORY; }
+      auto * p = std::malloc(size ? size : 1);
+      if (!p) { return CUDA_ERROR_OUT_OF_MEMORY; }
+      *dptr = reinterpret_cast<CUdeviceptr>(p);
+      allocations[*dptr] = size;
+      used += size;
+      return CUDA_SUCCESS;
+    }
+
+    CUresult free(CUdeviceptr dptr)
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      auto it = allocations.find(dptr);
+      if (it == allocations.end()) { return CUDA_ERROR_INVALID_VALUE; }
+      used -= it->second;
+      allocations.erase(it);
+      std::free(reinterpret_cast<void *>(dptr));
+      return CUDA_SUCCESS;
+    }
+  } g_device;
+
+  void * host_ptr(CUdeviceptr dptr) { return reinterpret_cast<void *>(dptr); }
+
+  using Clock = std::chrono::steady_clock;
+
+  Clock::time_point * recorded_at(CUevent event)
+  {
+    return reinterpret_cast<Clock::time_point *>(event);
+  }
+
+  int device_count()
+  {
+    auto const * env = std::getenv("STUB_CUDA_DEVICE_COUNT");
+    return env ? std::stoi(env) : 1;
+  }
+}
+
+extern "C"
+{
+  // Entry points are the stub's own symbols, by their versioned name if
+  // they have one.
+  #if CUDA_VERSION >= 12000
+  CUresult cuGetProcAddress(
+      char const * symbol, void ** pfn, int, cuuint64_t
+    , CUdriverProcAddressQueryResult * status
+    )
+  #else
+  CUresult cuGetProcAddress(char const * symbol, void ** pfn, int, cuuint64_t)
+  #endif
+  {
+    static void * const self = []
+      {
+        Dl_info info;
+        dladdr(reinterpret_cast<void *>(&device_count), &info);
+        return dlopen(info.dli_fname, RTLD_NOW | RTLD_NOLOAD);
+      }();
+    *pfn = dlsym(self, (std::string(symbol) + "_v2").c_str());
+    if (!*pfn) { *pfn = dlsym(self, symbol); }
+    #if CUDA_VERSION >= 12000
+    if (status) {
+      *status = *pfn ? CU_GET_PROC_ADDRESS_SUCCESS : CU_GET_PROC_ADDRESS_SYMBOL_NOT_FOUND;
+    }
+    #endif
+    return *pfn ? CUDA_SUCCESS : CUDA_ERROR_NOT_FOUND;
+  }
+
+  CUresult cuGetErrorString(CUresult error, char const ** str)
+  {
+    switch (error) {
+      case CUDA_SUCCESS: *str = "no error"; break;
+      case CUDA_ERROR_OUT_OF_MEMORY: *str = "out of memory"; break;
+      case CUDA_ERROR_INVALID_VALUE: *str = "invalid argument"; break;
+      default: *str = "unknown error (stub driver)"; break;
+    }
+    return CUDA_SUCCESS;
+  }
+
+  // Devices
+  CUresult cuDeviceGetCount(int * count)
+  {
+    *count = device_count();
+    return CUDA_SUCCESS;
+  }
+
+  CUresult cuDeviceGet(CUdevice * device, int ordinal)
+  {
+    if (ordinal < 0 || ordinal >= device_count()) { return CUDA_ERROR_INVALID_VALUE; }
+    *device = ordinal;
+    return CUDA_SUCCESS;
+  }
+
+  CUresult cuDeviceCanAccessPeer(int * can, CUdevice, CUdevice)
+  {
+    *can = 1;
+    return CUDA_SUCCESS;
+  }
+
+  CUresult cuDevicePrimaryCtxRetain(CUcontext * pctx, CUdevice)
+  {
+    return cuCtxGetCurrent(pctx);
+  }
+
+  // Contexts
+  CUresult cuCtxGetCurrent(CUcontext * pctx)
+  {
+    *pctx = reinterpret_cast<CUcontext>(&g_device);
+    return CUDA_SUCCESS;
+  }
+
+  CUresult cuCtxSetCurrent(CUcontext) { return CUDA_SUCCESS; }
+  CUresult cuCtxPushCurrent(CUcontext) { return CUDA_SUCCESS; }
+
+  CUresult cuCtxPopCurrent(CUcontext * pctx)
+  {
+    if (pctx) { *pctx = reinterpret_cast<CUcontext>(&g_device); }
+    return CUDA_SUCCESS;
+  }
+
+  CUresult cuCtxGetDevice(CUdevice * device)
+  {
+    *device = 0;
+    return CUDA_SUCCESS;
+  }
+
+  CUresult cuStreamGetCtx(CUstream, CUcontext * pctx) { return cuCtxGetCurrent(pctx); }
+  CUresult cuCtxEnablePeerAccess(CUcontext, unsigned int) { return CUDA_SUCCESS; }
+
+  // Streams and pools
+  CUresult cuCtxGetStreamPriorityRange(int * least, int * greatest)
+  {
+    *least = 0;
+    *greatest = -5;
+    return CUDA_SUCCESS;
+  }
+
+  CUresult cuStreamCreateWithPriority(CUstream * stream, unsigned int, int)
+  {
+    static std::atomic<uintptr_t> next{0x10000};
+    *stream = reinterpret_cast<CUstream>(next.fetch_add(0x10));
+    return CUDA_SUCCESS;
+  }
+
+  CUresult cuStreamDestroy(CUstream) { return CUDA_SUCCESS; }
+
+  // Capture only marks the stream; work issued meanwhile still runs.
+  CUresult cuStreamBeginCapture(CUstream stream, CUstreamCaptureMode)
+  {
+    std::lock_guard<std::mutex> lock(g_device.mutex);
+    g_device.capturing.insert(stream);
+    return CUDA_SUCCESS;
+  }
+
+  CUresult cuStreamEndCapture(CUstream stream, CUgraph * graph)
+  {
+    std::lock_guard<std::mutex> lock(g_device.mutex);
+    g_device.capturing.erase(stream);
+    if (graph) { *graph = nullptr; }
+    return CUDA_SUCCESS;
+  }
+
+  CUresult cuStreamIsCapturing(CUstream stream, CUstreamCaptureStatus * status)
+  {
+    std::lock_guard<std::mutex> lock(g_device.mutex);
+    *status = g_device.capturing.count(stream)
+      ? CU_STREAM_CAPTURE_STATUS_ACTIVE : CU_STREAM_CAPTURE_STATUS_NONE;
+    return CUDA_SUCCESS;
+  }
+
+  CUresult cuGraphExecDestroy(CUgraphExec) { return CUDA_SUCCESS; }
+  CUresult cuStreamSynchronize(CUstream) { return CUDA_SUCCESS; }
+  CUresult cuStreamWaitEvent(CUstream, CUevent, unsigned int) { return CUDA_SUCCESS; }
+  CUresult cuMemPoolDestroy(CUmemoryPool) { return CUDA_SUCCESS; }
+  CUresult cuMemPoolTrimTo(CUmemoryPool, size_t) { return CUDA_SUCCESS; }
+
+  CUresult cuMemPoolSetAccess(CUmemoryPool, CUmemAccessDesc const *, size_t)
+  {
+    return CUDA_SUCCESS;
+  }
+
+  // Events, which hold the time they were recorded
+  CUresult cuEventCreate(CUevent * event, unsigned int)
+  {
+    *event = reinterpret_cast<CUevent>(new Clock::time_point{});
+    return CUDA_SUCCESS;
+  }
+
+  CUresult cuEventDestroy(CUevent event)
+  {
+    delete recorded_at(event);
+    return CUDA_SUCCESS;
+  }
+
+  CUresult cuEventRecord(CUevent event, CUstream)
+  {
+    *recorded_at(event) = Clock::now();
+    return CUDA_SUCCESS;
+  }
+
+  CUresult cuEventElapsedTime(float * ms, CUevent start, CUevent end)
+  {
+    *ms = std::chrono::duration<float, std::milli>(*recorded_at(end) - *recorded_at(start)).count();
+    return CUDA_SUCCESS;
+  }
+  CUresult cuEventQuery(CUevent) { return CUDA_SUCCESS; }
+  CUresult cuEventSynchronize(CUevent) { return CUDA_SUCCESS; }
+
+  // Memory
+  CUresult cuMemAllocFromPoolAsync(
+      CUdeviceptr * dptr, size_t size, CUmemoryPool, CUstream
+    )
+  {
+    return g_device.allocate(dptr, size);
+  }
+
+  CUresult cuMemFreeAsync(CUdeviceptr dptr, CUstream) { return g_device.free(dptr); }
+
+  CUresult cuMemAllocManaged(CUdeviceptr * dptr, size_t size, unsigned int)
+  {
+    return g_device.allocate(dptr, size);
+  }
+
+  CUresult cuMemFree(CUdeviceptr dptr) { return g_device.free(dptr); }
+  CUresult cuMemPrefetchAsync(CUdeviceptr, size_t, CUdevice, CUstream) { return CUDA_SUCCESS; }
+  CUresult cuMemAdvise(CUdeviceptr, size_t, CUmem_advise, CUdevice) { return CUDA_SUCCESS; }
+
+  CUresult cuMemAllocHost(void ** pp, size_t size)
+  {
+    *pp = std::malloc(size ? size : 1);
+    return *pp ? CUDA_SUCCESS : CUDA_ERROR_OUT_OF_MEMORY;
+  }
+
+  CUresult cuMemHostAlloc(void ** pp, size_t size, unsigned int)
+  {
+    return cuMemAllocHost(pp, size);
+  }
+
+  CUresult cuMemFreeHost(void * p)
+  {
+    std::free(p);
+    return CUDA_SUCCESS;
+  }
+
+  // Like the driver, rejects ranges that overlap a registration, and
+  // unregistering anything but the start of a registration.
+  CUresult cuMemHostRegister(void * p, size_t size, unsigned int)
+  {
+    auto const begin = reinterpret_cast<uintptr_t>(p);
+    std::lock_guard<std::mutex> lock(g_device.mutex);
+    auto const next = g_device.registered.lower_bound(begin);
+    if (next != g_device.registered.end() && next->first < begin + size) {
+      return CUDA_ERROR_HOST_MEMORY_ALREADY_REGISTERED;
+    }
+    if (next != g_device.registered.begin() && std::prev(next)->first + std::prev(next)->second > begin) {
+      return CUDA_ERROR_HOST_MEMORY_ALREADY_REGISTERED;
+    }
+    g_device.registered.emplace(begin, size);
+    return CUDA_SUCCESS;
+  }
+
+  CUresult cuMemHostUnregister(void * p)
+  {
+    std::lock_guard<std::mutex> lock(g_device.mutex);
+    return g_device.registered.erase(reinterpret_cast<uintptr_t>(p)) ? CUDA_SUCCESS : CUDA_ERROR_HOST_MEMORY_NOT_REGISTERED;
+  }
+
+  CUresult cuMemcpyAsync(CUdeviceptr dst, CUdeviceptr src, size_t size, CUstream)
+  {
+    std::memcpy(host_ptr(dst), host_ptr(src), size);
+    return CUDA_SUCCESS;
+  }
+
+  CUresult cuMemcpyHtoDAsync(
+      CUdeviceptr dst, void const * src, size_t size, CUstream
+    )
+  {
+    std::memcpy(host_ptr(dst), src, size);
+    return CUDA_SUCCESS;
+  }
+
+  CUresult cuMemcpyDtoHAsync(void * dst, CUdeviceptr src, size_t size, CUstream)
+  {
+    std::memcpy(dst, host_ptr(src), size);
+    return CUDA_SUCCESS;
+  }
+
+  // Kernels are host functions taking the parameter array, so a function
+  // handle is the address of a void (void **) function.
+  CUresult cuLaunchKernel(
+      CUfunction function
+    , unsigned int, unsigned int, unsigned int
+    , unsigned int, unsigned int, unsigned int
+    , unsigned int, CUstream, void ** params, void ** extra
+    )
+  {
+    if (!function || extra) { return CUDA_ERROR_INVALID_VALUE; }
+    reinterpret_cast<void (*)(void **)>(function)(params);
+    return CUDA_SUCCESS;
+  }
+
+  // Like kernels, host functions run when they are issued.
+  CUresult cuLaunchHostFunc(CUstream, CUhostFn fn, void * data)
+  {
+    if (!fn) { return CUDA_ERROR_INVALID_VALUE; }
+    fn(data);
+    return CUDA_SUCCESS;
+  }
+}
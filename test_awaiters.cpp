@@ -0,0 +1,179 @@
+// Tests of cuda_core_awaiters.hpp against the stub driver. Build and run
+// them with `./build.sh test`.
+
+#include "cuda_core_awaiters.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cuda.h>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#define CHECK(expr) \
+  if (!(expr)) { std::fprintf(stderr, "%s:%d: CHECK failed: %s\n", __FILE__, __LINE__, #expr); std::exit(1); }
+
+namespace
+{
+  // A coroutine that starts at once, and sets done when it finishes.
+  struct Task
+  {
+    struct promise_type
+    {
+      Task get_return_object() { return {}; }
+      std::suspend_never initial_suspend() noexcept { return {}; }
+      std::suspend_never final_suspend() noexcept { return {}; }
+      void return_void() {}
+      void unhandled_exception() { std::abort(); }
+    };
+  };
+
+  void wait_until(std::atomic<bool> const & flag)
+  {
+    auto const deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+    while (!flag) {
+      CHECK(std::chrono::steady_clock::now() < deadline);
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+  }
+
+  // Boxes as in the holders module, awaited through shared_ptr holders.
+  struct StreamBox { CUstream res; };
+  struct EventBox { CUevent res; };
+
+  Task await_stream(CUstream stream, std::thread::id & resumed_on, std::atomic<bool> & done)
+  {
+    co_await cuda_holders::completed(stream);
+    resumed_on = std::this_thread::get_id();
+    done = true;
+  }
+
+  Task await_event(CUevent event, std::thread::id & resumed_on, std::atomic<bool> & done)
+  {
+    co_await cuda_holders::completed(event);
+    resumed_on = std::this_thread::get_id();
+    done = true;
+  }
+
+  Task await_with_executor(CUstream stream, cuda_holders::Executor executor, std::atomic<bool> & done)
+  {
+    co_await cuda_holders::completed(stream, std::move(executor));
+    done = true;
+  }
+
+  template<typename Holder>
+  Task await_holder(Holder holder, cuda_holders::Executor executor, std::atomic<bool> & done)
+  {
+    co_await cuda_holders::completed(std::move(holder), std::move(executor));
+    done = true;
+  }
+
+  void test_await_stream(CUstream stream)
+  {
+    std::atomic<bool> done{false};
+    std::thread::id resumed_on;
+    await_stream(stream, resumed_on, done);
+    wait_until(done);
+    CHECK(resumed_on != std::this_thread::get_id());
+  }
+
+  void test_await_event(CUstream stream)
+  {
+    CUevent event = nullptr;
+    CHECK(cuEventCreate(&event, CU_EVENT_DISABLE_TIMING) == CUDA_SUCCESS);
+    CHECK(cuEventRecord(event, stream) == CUDA_SUCCESS);
+    std::atomic<bool> done{false};
+    std::thread::id resumed_on;
+    await_event(event, resumed_on, done);
+    wait_until(done);
+    CHECK(resumed_on != std::this_thread::get_id());
+    CHECK(cuEventDestroy(event) == CUDA_SUCCESS);
+  }
+
+  // Every wait, on a stream or an event, resumes on the one poller thread.
+  void test_one_poller_thread(CUstream stream)
+  {
+    constexpr int n = 64;
+    std::vector<CUevent> events(n);
+    std::vector<std::thread::id> resumed_on(2 * n);
+    std::vector<std::atomic<bool>> done(2 * n);
+    for (int i = 0; i < n; ++i) {
+      CHECK(cuEventCreate(&events[i], CU_EVENT_DISABLE_TIMING) == CUDA_SUCCESS);
+      CHECK(cuEventRecord(events[i], stream) == CUDA_SUCCESS);
+      await_event(events[i], resumed_on[2 * i], done[2 * i]);
+      await_stream(stream, resumed_on[2 * i + 1], done[2 * i + 1]);
+    }
+    for (auto & flag : done) { wait_until(flag); }
+    for (auto const & id : resumed_on) { CHECK(id == resumed_on.front()); }
+    for (auto event : events) { CHECK(cuEventDestroy(event) == CUDA_SUCCESS); }
+  }
+
+  // The awaiter holds the holder until the coroutine is handed to the
+  // executor, and drops it afterwards.
+  template<typename Box>
+  void test_holder_held(decltype(Box::res) res)
+  {
+    std::atomic<bool> dropped{false};
+    std::atomic<bool> dropped_at_handoff{true};
+    std::mutex mutex;
+    std::vector<std::coroutine_handle<>> queued;
+    std::atomic<bool> done{false};
+    {
+      std::shared_ptr<Box> holder(new Box{res}, [&](Box * box) { delete box; dropped = true; });
+      await_holder(std::move(holder), [&](std::coroutine_handle<> h)
+        {
+          dropped_at_handoff = dropped.load();
+          std::lock_guard<std::mutex> lock(mutex);
+          queued.push_back(h);
+        }, done);
+    }
+    wait_until(dropped);
+    CHECK(!dropped_at_handoff);
+    std::lock_guard<std::mutex> lock(mutex);
+    CHECK(queued.size() == 1);
+    CHECK(!done);
+    queued.front().resume();
+    CHECK(done);
+  }
+
+  void test_executor_resumes(CUstream stream)
+  {
+    std::mutex mutex;
+    std::vector<std::coroutine_handle<>> queued;
+    std::atomic<bool> handed_off{false};
+    std::atomic<bool> done{false};
+    await_with_executor(stream, [&](std::coroutine_handle<> h)
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        queued.push_back(h);
+        handed_off = true;
+      }, done);
+    wait_until(handed_off);
+    std::lock_guard<std::mutex> lock(mutex);
+    CHECK(queued.size() == 1);
+    CHECK(!done);
+    queued.front().resume();
+    CHECK(done);
+  }
+}
+
+int main()
+{
+  CUstream stream = nullptr;
+  CHECK(cuStreamCreateWithPriority(&stream, CU_STREAM_NON_BLOCKING, 0) == CUDA_SUCCESS);
+  test_await_stream(stream);
+  test_await_event(stream);
+  test_executor_resumes(stream);
+  test_one_poller_thread(stream);
+  test_holder_held<StreamBox>(stream);
+  CUevent event = nullptr;
+  CHECK(cuEventCreate(&event, CU_EVENT_DISABLE_TIMING) == CUDA_SUCCESS);
+  CHECK(cuEventRecord(event, stream) == CUDA_SUCCESS);
+  test_holder_held<EventBox>(event);
+  CHECK(cuEventDestroy(event) == CUDA_SUCCESS);
+  CHECK(cuStreamDestroy(stream) == CUDA_SUCCESS);
+  std::printf("6 tests passed\n");
+}
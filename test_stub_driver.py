@@ -0,0 +1,494 @@
+"""Tests for the holders module that run against the stub driver.
+
+Build the module and the stub driver, then run with the stub first on the
+library path:
+
+    ./build.sh stub
+    LD_LIBRARY_PATH=stub python test_stub_driver.py
+
+With the stub driver, device memory is host memory, so device pointers can
+be read and written with ctypes.
+"""
+import asyncio
+import ctypes
+import mmap
+import os
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+import weakref
+
+os.environ.setdefault("STUB_CUDA_DEVICE_COUNT", "2")
+
+import cuda_core_holders_demo as holders
+
+
+def make_owners():
+    pool = holders.MemPool.capture_static(0x1)
+    stream = holders.Stream.capture_static(0x2)
+    return pool, stream
+
+
+def stub_call(name, *args):
+    """Calls a stub driver function, by its versioned name if it has one."""
+    driver = ctypes.CDLL("libcuda.so.1")
+    try:
+        fn = getattr(driver, name + "_v2")
+    except AttributeError:
+        fn = getattr(driver, name)
+    assert fn(*args) == 0
+
+
+def wait_until(predicate, timeout=5.0):
+    deadline = time.monotonic() + timeout
+    while not predicate():
+        assert time.monotonic() < deadline, "timed out"
+        time.sleep(0.001)
+
+
+def test_load_file():
+    data = bytes(i * 7 % 256 for i in range(100_000))
+    pool, stream = make_owners()
+    with tempfile.NamedTemporaryFile() as f:
+        f.write(data)
+        f.flush()
+
+        dst = holders.Deviceptr.allocate(len(data), pool, stream)
+        loaded = holders.load_file(f.name, dst, stream, chunk_size=4096, nbuffers=3)
+        assert loaded == len(data)
+        assert ctypes.string_at(int(dst), len(data)) == data
+
+        loaded = holders.load_file(f.name, dst, stream, dst_offset=10,
+                                   file_offset=50_000, length=100, chunk_size=7)
+        assert loaded == 100
+        assert ctypes.string_at(int(dst) + 10, 100) == data[50_000:50_100]
+
+        try:
+            holders.load_file(f.name, dst, stream, dst_offset=10)
+        except IndexError:
+            pass
+        else:
+            assert False, "loaded past the end of a Deviceptr"
+
+
+def test_retain_until_complete():
+    class Payload:
+        pass
+
+    _, stream = make_owners()
+    payload = Payload()
+    ref = weakref.ref(payload)
+    stream.retain_until_complete(payload, [1, 2, 3])
+    del payload
+    wait_until(lambda: ref() is None)
+
+
+def test_release_after():
+    pool, stream = make_owners()
+    other = holders.Stream.capture_static(0x3)
+    before = holders.usage()["devptrs"]
+    buffers = [holders.Deviceptr.allocate(64, pool, stream) for _ in range(3)]
+    assert holders.usage()["devptrs"] == before + 3
+
+    holders.release_after(other, *buffers[:2])
+    buffers[2].release_after(other)
+    del buffers
+    wait_until(lambda: holders.usage()["devptrs"] == before)
+
+
+def test_device_partitions():
+    before = holders.usage(device=5)["mempools"]
+    pool = holders.MemPool.capture(0x5000, device=5)
+    assert pool.device == 5
+    assert holders.MemPool.capture(0x5000, device=5).device == 5
+    assert holders.MemPool.capture(0x5000, device=6) is pool
+    assert holders.usage(device=5)["mempools"] == before + 1
+    assert holders.usage(device=6)["mempools"] == 0
+
+    stream = holders.Stream.capture_static(0x2)
+    buffer = holders.Deviceptr.allocate(64, pool, stream)
+    assert buffer.device == 5
+    assert holders.usage(device=5)["devptrs"] >= 1
+    del buffer, pool
+    assert holders.usage(device=5)["mempools"] == before
+
+def test_peer_copy():
+    stream = holders.Stream.capture_static(0x2)
+    pools = [holders.MemPool.capture(0x6000 + 0x10 * d, device=d) for d in (0, 1)]
+    src, dst = (holders.Deviceptr.allocate(32, pool, stream) for pool in pools)
+    ctypes.memmove(int(src), bytes(range(32)), 32)
+
+    holders.copy(dst, src, 32, stream)
+    assert ctypes.string_at(int(dst), 32) == bytes(range(32))
+    assert holders.enable_peer_access(0, 1)
+    assert pools[1].grant_access(0)
+    assert not holders.enable_peer_access(0, 7)
+
+
+def test_managed_prefetch_and_advise():
+    stream = holders.Stream.capture_static(0x2)
+    ptr = holders.ManagedPtr.allocate(1 << 16)
+    ranges = [(ptr, offset, 4096, 0) for offset in range(0, 1 << 16, 4096)]
+    assert holders.ManagedPtr.prefetch(ranges + ranges, stream) == 16
+    assert holders.ManagedPtr.prefetch(ranges, stream) == 16
+    assert holders.ManagedPtr.prefetch([(ptr, 0, 1 << 16, -1)], stream) == 1
+
+    set_read_mostly = 1
+    assert holders.ManagedPtr.advise([(ptr, 0, 100, set_read_mostly, 0)] * 2) == 1
+
+def test_stream_scheduler():
+    scheduler = holders.StreamScheduler(
+        [("latency", 2, -5), ("batch", 3, 0)], policy="round_robin")
+    first, second, third = (scheduler.acquire("latency") for _ in range(3))
+    assert int(first) != int(second)
+    assert int(first) == int(third)
+
+    scheduler.track(first)
+    assert scheduler.submitted() == {"latency": [1, 0], "batch": [0, 0, 0]}
+    assert scheduler.depths() == {"latency": [0, 0], "batch": [0, 0, 0]}
+
+def test_stream_timed():
+    _, stream = make_owners()
+    for _ in range(3):
+        with stream.timed("stage"):
+            time.sleep(0.002)
+    wait_until(lambda: holders.timings().get("stage", {}).get("count") == 3)
+    stage = holders.timings()["stage"]
+    assert stage["min_ms"] >= 1.0
+    assert sum(stage["buckets_us_log2"]) == 3
+
+def test_free_during_capture():
+    pool, other = make_owners()
+    stream = holders.Stream.capture_static(0x7000)
+    before = holders.usage()["devptrs"]
+
+    stub_call("cuStreamBeginCapture", ctypes.c_void_p(0x7000), 0)
+    buffer = holders.Deviceptr.allocate(64, pool, stream)
+    del buffer
+    assert holders.usage()["devptrs"] == before + 1
+    assert holders.flush_capture_deferred() == 0
+    stub_call("cuStreamEndCapture", ctypes.c_void_p(0x7000), None)
+
+    # Unrelated releases leave the deferred free to the graph.
+    unrelated = holders.Deviceptr.allocate(64, pool, other)
+    del unrelated
+    graph = holders.GraphExec.capture(0x7100, stream)
+    assert graph.adopted == 1
+    del graph
+    assert holders.usage()["devptrs"] == before
+
+
+def test_library_handle_per_stream():
+    LibraryHandle = holders.testing.LibraryHandle
+    before = holders.testing.library_handles()
+    stream = holders.Stream.capture(0x8000)
+    handle = LibraryHandle.get(stream)
+    assert handle.stream == 0x8000
+    assert int(LibraryHandle.get(stream)) == int(handle)
+    assert int(LibraryHandle.get(holders.Stream.capture_static(0x8100))) != int(handle)
+
+    # The handle holds its stream.
+    del stream
+    assert holders.testing.library_handles()["destroyed"] == before["destroyed"]
+    del handle
+    after = holders.testing.library_handles()
+    assert after["created"] == before["created"] + 2
+    assert after["destroyed"] == before["destroyed"] + 1
+
+def test_sharded_holders_across_threads():
+    assert holders.testing.sharded_holders(nthreads=4, iters=2000) == {
+        "copies_across_threads": True,
+        "foreign_drops": True,
+        "thread_exit": True,
+    }
+
+def test_workspace_grows_and_follows_stream():
+    pool, _ = make_owners()
+    stream = holders.Stream.capture(0x8200)
+    before = holders.workspace_stats()
+    first = holders.workspace(stream, 100, pool)
+    assert int(holders.workspace(stream, 64, pool)) == int(first)
+    grown = holders.workspace(stream, 150, pool)
+    assert int(grown) != int(first)
+    assert int(holders.workspace(stream, 200, pool)) == int(grown)
+    stats = holders.workspace_stats()
+    assert stats["allocations"] == before["allocations"] + 2
+    assert stats["hits"] == before["hits"] + 2
+    assert stats["bytes"] == before["bytes"] + 200
+
+    # Workspaces hold their stream.
+    del stream
+    assert holders.workspace_stats()["workspaces"] == before["workspaces"] + 1
+    del first, grown
+    assert holders.workspace_stats()["workspaces"] == before["workspaces"]
+
+    # Each thread has its own workspaces on the per-thread default stream.
+    per_thread = holders.Stream.capture_static(0x2)
+    ours = holders.workspace(per_thread, 64, pool)
+    theirs = []
+    thread = threading.Thread(target=lambda: theirs.append(holders.workspace(per_thread, 64, pool)))
+    thread.start()
+    thread.join()
+    assert int(theirs[0]) != int(ours)
+
+def test_launch_packs_holders_and_values():
+    pool, stream = make_owners()
+    before = holders.usage()["devptrs"]
+    buffer = holders.Deviceptr.allocate(16, pool, stream)
+    seen = []
+
+    @ctypes.CFUNCTYPE(None, ctypes.POINTER(ctypes.c_void_p))
+    def kernel(params):
+        words = [ctypes.cast(params[i], ctypes.POINTER(ctypes.c_uint64))[0] for i in range(3)]
+        real = ctypes.cast(params[3], ctypes.POINTER(ctypes.c_float))[0]
+        raw = ctypes.string_at(params[4], 2)
+        seen.append((words, real, raw))
+
+    function = ctypes.cast(kernel, ctypes.c_void_p).value
+    holders.launch(function, (2, 2), 32, stream, buffer, 7, -1, ctypes.c_float(0.5), b"\x01\x02")
+    assert seen == [([int(buffer), 7, 2**64 - 1], 0.5, b"\x01\x02")]
+
+    del buffer
+    wait_until(lambda: holders.usage()["devptrs"] == before)
+    assert holders.launch_holds_waiting() == 0
+
+    # Launches on other streams are held in batches.
+    other = holders.Stream.capture_static(0x3)
+    for _ in range(10):
+        buffer = holders.Deviceptr.allocate(16, pool, other)
+        holders.launch(function, 1, 1, other, buffer, 0, 0, ctypes.c_float(0), b"\x00\x00")
+    del buffer
+    wait_until(lambda: holders.usage()["devptrs"] == before)
+    wait_until(lambda: holders.launch_holds_waiting() == 0)
+
+    for arg in ("text", 0.5):
+        try:
+            holders.launch(function, 1, 1, stream, arg)
+        except ValueError:
+            pass
+        else:
+            assert False, f"launched with a {type(arg).__name__} argument"
+
+def test_await_completion():
+    _, stream = make_owners()
+    handle = ctypes.c_void_p()
+    stub_call("cuEventCreate", ctypes.byref(handle), 0)
+    event = holders.Event.capture(handle.value)
+    event.record(stream)
+
+    async def main():
+        await stream.completed()
+        await event.completed()
+        await asyncio.gather(*(stream.completed() for _ in range(2000)))
+
+    # A fresh loop each time, dropping the notifier of the last one.
+    asyncio.run(main())
+    asyncio.run(main())
+
+def test_deviceptr_slices_hold_their_allocation():
+    pool, stream = make_owners()
+    before = holders.usage()["devptrs"]
+    buffer = holders.Deviceptr.allocate(256, pool, stream)
+    head = buffer.slice(0, 128)
+    tail = head.slice(64, 64).slice(32, 32)
+    assert int(tail) == int(buffer) + 96 and tail.size == 32
+    assert int(tail.parent) == int(buffer)
+    try:
+        head.slice(100, 29)
+    except IndexError:
+        pass
+    else:
+        assert False, "sliced past the end of a slice"
+
+    del buffer, head
+    assert holders.usage()["devptrs"] == before + 1
+    del tail
+    assert holders.usage()["devptrs"] == before
+
+def test_slot_deviceptr_has_the_deviceptr_api():
+    def api(cls):
+        return {name for name in dir(cls) if not name.startswith("_")}
+    assert api(holders.slots.Deviceptr) == api(holders.Deviceptr)
+
+    pool, stream = make_owners()
+    before = holders.usage()["devptrs"]
+    buffer = holders.slots.Deviceptr.allocate(size=128, pool=pool, stream=stream)
+    assert buffer.size == 128
+    view = buffer.slice(32, 64).slice(8, 8)
+    assert int(view) == int(buffer) + 40
+    assert int(view.parent) == int(buffer)
+    del buffer
+    assert holders.usage()["devptrs"] == before + 1
+    del view
+    assert holders.usage()["devptrs"] == before
+
+    buffer = holders.slots.Deviceptr.allocate(16, pool, stream)
+    buffer.release_after(holders.Stream.capture_static(0x3))
+    del buffer
+    wait_until(lambda: holders.usage()["devptrs"] == before)
+
+def test_find_owner_of_interior_pointers():
+    pool, stream = make_owners()
+    holders.enable_owner_index()
+    try:
+        buffers = [holders.Deviceptr.allocate(64 + i, pool, stream) for i in range(100)]
+    finally:
+        holders.enable_owner_index(False)
+    unindexed = holders.Deviceptr.allocate(64, pool, stream)
+
+    for i, buffer in enumerate(buffers):
+        assert int(holders.find_owner(int(buffer) + 63 + i)) == int(buffer)
+    assert holders.find_owner(int(unindexed)) is None
+
+    address = int(buffers[0]) + 10
+    del buffers[0]
+    assert holders.find_owner(address) is None
+    try:
+        buffers[0].slice(60, 6)
+    except IndexError:
+        pass
+    else:
+        assert False, "sliced past the end of a Deviceptr"
+
+def test_driver_loaded_on_first_use():
+    script = """if True:
+        import cuda_core_holders_demo as holders
+        assert holders.driver_path() is None
+        holders.load_driver("libcuda.so.1")
+        holders.Stream.capture_static(0x2)
+        assert holders.driver_path() == "libcuda.so.1"
+        try:
+            holders.load_driver("other/libcuda.so.1")
+        except RuntimeError:
+            pass
+        else:
+            assert False, "swapped a loaded driver"
+    """
+    subprocess.run([sys.executable, "-c", script], check=True)
+
+def test_host_registrations_are_shared():
+    page = mmap.PAGESIZE
+    memory = mmap.mmap(-1, 8 * page)
+    base = ctypes.addressof(ctypes.c_char.from_buffer(memory))
+
+    # Registering a buffer holds its export.
+    whole = holders.HostRegistration.register(memory)
+    assert (int(whole), whole.size) == (base, 8 * page)
+    try:
+        memory.close()
+    except BufferError:
+        pass
+    else:
+        assert False, "closed a registered buffer"
+    try:
+        holders.HostRegistration.register(memoryview(memory)[::2])
+    except BufferError:
+        pass
+    else:
+        assert False, "registered a non-contiguous buffer"
+
+    assert holders.HostRegistration.register(base + page + 1, 100) is whole.parts[0]
+
+    # Overlapping the end registers only the pages past it.
+    wider = holders.HostRegistration.register(base + 6 * page, 4 * page)
+    assert [int(part) for part in wider.parts] == [base, base + 8 * page]
+    assert holders.HostRegistration.registered() == [(base, 8 * page), (base + 8 * page, 2 * page)]
+    try:
+        holders.HostRegistration.register(base, page, flags=1)
+    except ValueError:
+        pass
+    else:
+        assert False, "registered over memory registered with other flags"
+
+    del whole
+    assert len(holders.HostRegistration.registered()) == 2
+    del wider
+    assert holders.HostRegistration.registered() == []
+    memory.close()
+
+def test_capture_returns_the_live_holder():
+    stream = holders.Stream.capture(0x9000)
+    assert holders.Stream.capture(0x9000) is stream
+    pool = holders.MemPool.capture(0x9100)
+    assert holders.MemPool.capture(0x9100) is pool
+    ptr = holders.Deviceptr.allocate(64, pool, stream)
+    assert holders.Deviceptr.capture(int(ptr), pool, stream) is ptr
+
+    # An allocation has one owner, so only one backend may capture it.
+    slot_ptr = holders.slots.Deviceptr.allocate(64, pool, stream)
+    for backend, other in ((holders.slots.Deviceptr, ptr), (holders.Deviceptr, slot_ptr)):
+        try:
+            backend.capture(int(other), pool, stream)
+        except ValueError:
+            pass
+        else:
+            assert False, "captured an allocation owned by another backend"
+
+def test_reclaim_recovers_allocations():
+    script = """if True:
+        import gc
+        import cuda_core_holders_demo as holders
+        gc.disable()
+        pool = holders.MemPool.capture_static(0x1)
+        stream = holders.Stream.capture_static(0x2)
+        holders.reclaim.set_enabled(["flush_deferred", "trim_pools", "gc"])
+
+        # Only a garbage collection pass frees the first buffer.
+        cycle = [holders.Deviceptr.allocate(3000, pool, stream)]
+        cycle.append(cycle)
+        del cycle
+        ptr = holders.Deviceptr.allocate(3000, pool, stream)
+        stats = holders.reclaim.stats()
+        assert stats["flush_deferred.attempts"] == stats["trim_pools.attempts"] == 1
+        assert stats["gc.recoveries"] == 1
+        assert stats["failures"] == 0
+
+        try:
+            holders.Deviceptr.allocate(3000, pool, stream)
+        except RuntimeError:
+            pass
+        else:
+            assert False, "allocated past the device's memory"
+        assert holders.reclaim.stats()["failures"] == 1
+    """
+    env = dict(os.environ, STUB_CUDA_DEVICE_BYTES="4096")
+    subprocess.run([sys.executable, "-c", script], check=True, env=env)
+
+def test_spill_and_restore_under_budget():
+    pool = holders.MemPool.capture_static(0x11)
+    _, stream = make_owners()
+    pool.set_spill_budget(200)
+    first, second = (holders.SpillableDeviceptr.allocate(100, pool, stream) for _ in range(2))
+    ctypes.memset(int(first), 7, 100)
+    int(second)
+
+    # Over budget, the least recently used buffer is spilled.
+    third = holders.SpillableDeviceptr.allocate(100, pool, stream)
+    assert first.spilled and not second.spilled and not third.spilled
+    assert pool.spill_resident_bytes == 200
+
+    # Reading it brings it back, and spills the next least recently used.
+    assert ctypes.string_at(int(first), 100) == b"\x07" * 100
+    assert second.spilled and not first.spilled
+    first.spill()
+    assert first.spilled and pool.spill_resident_bytes == 100
+    assert ctypes.string_at(int(first), 100) == b"\x07" * 100
+
+def test_front_cache_counts():
+    before = holders.front_cache_stats()
+    stream = holders.Stream.capture(0x9300)
+    assert holders.Stream.capture(0x9300) is stream
+    del stream
+    holders.Stream.capture(0x9300)
+    after = holders.front_cache_stats()
+    counts = {name: after[name] - before.get(name, 0) for name in after}
+    assert counts == {"hits": 1, "misses": 1, "invalidations": 1}
+
+if __name__ == "__main__":
+    tests = [(name, fn) for name, fn in globals().items() if name.startswith("test_")]
+    for name, fn in tests:
+        print(f"{name} ...", flush=True)
+        fn()
+    print(f"{len(tests)} tests passed")